@@ -28,9 +28,40 @@
 
 
 #include <iostream>
-#include <unistd.h>   // for usleep() (Windows can get unistd.h via Cygwin or Mingw-w64)
+#include <string>
+#include <string_view>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <sstream>
+#include <fstream>
+#include <cctype>
+#include <iomanip>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <array>
+#include <cstdio>
+#include <fcntl.h>       // for reading image files (Windows can get these via Cygwin)
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>    // for mapping image files and the JIT's executable memory
+#include <sys/socket.h>  // for GdbServer and the fleet
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
 
-const int millisecondsPerInstruction = 50;
+const int defaultMillisecondsPerCycle = 50;
 
 
 
@@ -95,182 +126,6508 @@ uint16_t getNibble4(uint16_t num) {
 
 
 /*
-    ROM is where the program's machine code will be put.
-    Think of it as flash memory that is only written to when a program is assembled.
-    ROM can also contain data used for initializing variables.
-    0xFFFF = 2^16 = 65536 is the max that 16-bit addresses can address.
-    I decided to make a uint16_t (instead of a uint8_t) the fundamental memory chunk.
+    Splitting an instruction into its nibbles every time it runs is wasted work,
+    since a running program's ROM doesn't change.
+    So each ROM address is decoded just once into a DecodedOp...
+        opcode   --> nibble 1
+        a, b, c  --> nibbles 2, 3, and 4 (registers, modes, or flags)
+        address  --> the second uint16_t of the instruction
+        handler  --> what runThreaded() runs for it (usually just the opcode, see below)
+        touchesFlags --> whether it reads or writes register 1 (see "lazy flags" in Cpu)
+        words    --> how many uint16_t's it takes, so how far the program counter moves (see "compact encoding")
+    A Cpu's decodedROM[i] is the instruction that starts at ROM[i], so any program counter works.
+    (Only the instructions a program can reach get decoded, though: see "control-flow graph".)
+
+    Some runs of instructions show up over and over, like the CMP then J that ends most loops.
+    runThreaded() has a "superinstruction" for each of these, which runs the whole run at once
+    (CMP_J even decides the jump from the flags it just worked out, without reading reg[1] back)...
+        CMP_J        --> CMP, then J
+        CPY_CPY      --> CPY, then CPY
+        ADD_CMP_J    --> ADD, then CMP, then J
+    When predecoding, the first instruction of each run gets the superinstruction as its handler.
+    The other instructions are left alone, so jumping to the middle of a run still works.
+    Which superinstructions get used is up to Cpu::fusions, which can come from a profile
+    of the program (see Profile::fusions()). Try...
+        ./cpu16 --turbo --fuse profile prog.s    --> profiles a test run, then fuses what's common
+        ./cpu16 --turbo --fuse none prog.s       --> no superinstructions
+
+    If you write to ROM[] directly after the program has started, call invalidateDecodedROM()
+    (or just use writeROM(), which keeps decodedROM[] up to date).
+
+    An instruction naming a register the Cpu doesn't have (see cpuRegisters) decodes as HLT,
+    like every undefined instruction, so nothing that runs a DecodedOp ever checks a register number.
+*/
+
+/*
+    How many registers programs get: 5 (reg[0] to reg[4]) unless compiled with, say...
+        g++ -DCPU16_REGISTERS=16 ...
+    16 is the most a 4-bit register number can name.
+    Cpu::reg[] always has 16 slots anyway, so an instruction can never reach past its end.
+*/
+#ifndef CPU16_REGISTERS
+#define CPU16_REGISTERS 5
+#endif
+constexpr int cpuRegisters = CPU16_REGISTERS;
+static_assert(cpuRegisters >= 2 && cpuRegisters <= 16, "CPU16_REGISTERS must be from 2 to 16");
+
+struct DecodedOp {
+    uint8_t opcode;
+    uint8_t a, b, c;
+    uint16_t address;
+    uint8_t handler;
+    bool touchesFlags;
+    uint8_t words;
+};
+
+// handlers after the 16 opcodes, and bit (handler - SUPER_FIRST) of Cpu::fusions turns each on
+enum Superinstruction { SUPER_FIRST = 16, SUPER_CMP_J = SUPER_FIRST, SUPER_CPY_CPY, SUPER_ADD_CMP_J, SUPER_END };
+const uint32_t fuseAll = (1 << (SUPER_END - SUPER_FIRST)) - 1;
+const char *superinstructionNames[SUPER_END - SUPER_FIRST] = { "CMP_J", "CPY_CPY", "ADD_CMP_J" };
+
+// the opcode (and handler) of a breakpoint patched into decodedROM[] (see Cpu::setBreakpoint())
+const uint8_t breakpointOpcode = SUPER_END;
+const DecodedOp breakpointOp = { breakpointOpcode, 0, 0, 0, 0, breakpointOpcode, false, 2 };
+
+// the handler of an instruction (other than a J) that ends a basic block (see Cpu::blockLength)
+const uint8_t blockEndHandler = breakpointOpcode + 1;
+
+// the opcode (and handler) in decodedROM[] wherever nothing has been decoded yet (see Cpu::decodeReachable())
+const uint8_t undecodedOpcode = blockEndHandler + 1;
+const DecodedOp undecodedOp = { undecodedOpcode, 0, 0, 0, 0, undecodedOpcode, false, 2 };
+
+// handlers for tiered running (see Cpu::runTiered()): a J back to an earlier address, which counts
+// how often it's taken, and the first instruction of a loop the JIT has taken over
+const uint8_t backEdgeHandler = undecodedOpcode + 1;
+const uint8_t jitEntryHandler = backEdgeHandler + 1;
+
+enum Tier : uint8_t { TIER_INTERPRETED, TIER_FUSED, TIER_JIT, TIER_JIT_ENTRY };
+
+/*
+    Compact encoding: most instructions never use their second uint16_t, so a program can
+    leave it out. In the compact encoding...
+        ADD SUB NOT AND OR CMP CPY OUT HLT  --> 1 uint16_t (and so do the undefined instructions)
+        MOV LD LDV J                        --> 2 uint16_t's, the second being the address (or value)
+    and the program counter moves past just the words the instruction took.
+    Most programs shrink by a third or more, so bigger programs fit in ROM,
+    and more of a program fits in your computer's caches.
+    An image says which encoding its ROM is in (see "image file"), and the Assembler
+    uses the compact one for a program starting with a ".compact" line. Try...
+        ./cpu16 --save-image fibc.img fibc.s    (where fibc.s is fib.s starting with .compact)
+    and compare the sizes of the ROM segments.
+    Cycle costs stay the same, since they already count fetching a second word (see cycleCosts).
+*/
+
+// how many uint16_t's an instruction with this opcode takes
+uint8_t instructionWords(uint8_t opcode, bool compact) {
+    return (!compact || opcode == 0x8 || opcode == 0x9 || opcode == 0xA || opcode == 0xE) ? 2 : 1;
+}
+
+// (address is ignored by instructions that don't use it, so with the compact encoding,
+// it can be the start of the next instruction)
+DecodedOp decode(uint16_t instruction, uint16_t address, bool compact = false) {
+    DecodedOp op;
+    op.opcode = getNibble1(instruction);
+    op.a = getNibble2(instruction);
+    op.b = getNibble3(instruction);
+    op.c = getNibble4(instruction);
+    op.address = address;
+    op.handler = op.opcode;
+    op.words = instructionWords(op.opcode, compact);
+
+    // the registers it names, one bit each (J's numbers are a mode and a flag, not registers)
+    uint32_t named;
+    switch (op.opcode) {
+      case 0x0:                          named = 1u << op.a | 1u << op.b | 1u << op.c;  break;
+      case 0x3: case 0x4: case 0x5: case 0x6:  named = 1u << op.a | 1u << op.b;  break;
+      case 0x2: case 0x7: case 0x8: case 0x9: case 0xA:  named = 1u << op.a;  break;
+      default:                           named = 0;  break;
+    }
+    if (named >> cpuRegisters) {
+        op.opcode = op.handler = 0xF;
+        named = 0;
+    }
+    op.touchesFlags = named & 2;
+    return op;
+}
+
+// whether an instruction can send the program counter anywhere but the next instruction:
+// J, HLT (and every undefined instruction), a breakpoint, and anything that writes reg[0]
+bool endsBlock(const DecodedOp &op) {
+    switch (op.opcode) {
+      case 0x0:  return op.c == 0;
+      case 0x3: case 0x4: case 0x5: case 0x7: case 0x8:  return false;
+      case 0x6:  return op.b == 0;
+      case 0x9: case 0xA:  return op.a == 0;
+      default:   return true;
+    }
+}
+
+
+
+
+
+/*
+    OUT sends values to an OutputSink. There are 3 kinds...
+        TextSink    --> prints each value on its own line, like you'd expect
+        BinarySink  --> writes each value as 2 raw bytes (in your computer's byte order)
+        RingSink    --> keeps values in memory for the code that runs the Cpu to drain()
+    Choose text or binary when running this code...
+        ./cpu16 --output binary > values.bin
+
+    Sinks save up their output in a buffer instead of making the operating system
+    write every value right away, which would take way longer than running the program!
+    The buffer is flushed when it fills up and when the CPU halts.
+*/
+
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+    virtual void write(uint16_t value) = 0;
+    virtual void flush() {}
+};
+
+class TextSink : public OutputSink {
+
+public:
+
+    explicit TextSink(std::ostream &stream) : stream(stream) {}
+    ~TextSink() { flush(); }
+
+    void write(uint16_t value) override {
+        if (used + 6 > sizeof(buffer))
+            flush();
+        char digits[5];
+        int n = 0;
+        do {
+            digits[n++] = '0' + value % 10;
+            value /= 10;
+        } while (value);
+        while (n)
+            buffer[used++] = digits[--n];
+        buffer[used++] = '\n';
+    }
+
+    void flush() override {
+        stream.write(buffer, used);
+        stream.flush();
+        used = 0;
+    }
+
+private:
+
+    std::ostream &stream;
+    char buffer[1 << 13];
+    size_t used = 0;
+
+};
+
+class BinarySink : public OutputSink {
+
+public:
+
+    explicit BinarySink(std::ostream &stream) : stream(stream) {}
+    ~BinarySink() { flush(); }
+
+    void write(uint16_t value) override {
+        if (used == sizeof(buffer) / sizeof(buffer[0]))
+            flush();
+        buffer[used++] = value;
+    }
+
+    void flush() override {
+        stream.write((const char *)buffer, used * sizeof(buffer[0]));
+        stream.flush();
+        used = 0;
+    }
+
+private:
+
+    std::ostream &stream;
+    uint16_t buffer[1 << 12];
+    size_t used = 0;
+
+};
+
+/*
+    A RingSink can be drained from another thread while the Cpu runs.
+    If it fills up because nobody drains it, new values are thrown away
+    (and counted in dropped) instead of making the Cpu wait.
+*/
+class RingSink : public OutputSink {
+
+public:
+
+    // capacity is rounded up to a power of 2
+    explicit RingSink(size_t capacity = 1 << 16) {
+        size_t size = 1;
+        while (size < capacity)
+            size *= 2;
+        values.resize(size);
+    }
+
+    void write(uint16_t value) override {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == values.size()) {
+            dropped++;
+            return;
+        }
+        values[t & (values.size() - 1)] = value;
+        tail.store(t + 1, std::memory_order_release);
+    }
+
+    // copies up to max values into destination, returning how many it copied
+    size_t drain(uint16_t *destination, size_t max) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t n = std::min(max, tail.load(std::memory_order_acquire) - h);
+        for (size_t i = 0; i < n; i++)
+            destination[i] = values[(h + i) & (values.size() - 1)];
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    std::atomic<uint64_t> dropped{0};
+
+private:
+
+    std::vector<uint16_t> values;
+    std::atomic<size_t> head{0}, tail{0};
+
+};
+
+
+
+
+
+/*
+    Instead of typing a program into main() and recompiling, you can save it as an image file...
+        ./cpu16 --save-image fib.img     --> saves the Fibonacci program below
+        ./cpu16 --turbo fib.img          --> runs it
+
+    An image file starts with this header (all numbers are little-endian)...
+        bytes 0-3     "C16I"
+        bytes 4-5     version (1)
+        bytes 6-7     entry point (where the program counter starts)
+        bytes 8-9     number of segments
+        bytes 10-11   flags: bit 0 is 1 if ROM is in the compact encoding (see instructionWords())
+    followed by 12 bytes for each segment...
+        bytes 0-1     memory it's loaded into (0 for ROM, 1 for RAM)
+        bytes 2-3     load address: where in that memory its first uint16_t goes
+        bytes 4-7     length (in uint16_t's)
+        bytes 8-11    where its data is in the file (in bytes from the start)
+    Anything in ROM that isn't in a segment is HLT.
+
+    Image::save() puts each segment's data at a multiple of 4096 bytes in the file.
+    That way, if the only ROM segment loads at ROM[0x0000], Cpu::loadImage() can have the
+    operating system map the file right into ROM (mmap) instead of copying anything.
+    The mapping is private, so writing to that ROM never changes the file or any other Cpu.
+*/
+
+enum SegmentMemory { SEGMENT_ROM = 0, SEGMENT_RAM = 1 };
+
+struct ImageSegment {
+    uint16_t memory = SEGMENT_ROM;
+    uint16_t address = 0;
+    uint32_t length = 0;             // in uint16_t's
+    uint32_t fileOffset = 0;         // in bytes, if this segment's data is in the Image's file
+    std::vector<uint16_t> words;     // otherwise, the data itself
+};
+
+const char imageMagic[4] = { 'C', '1', '6', 'I' };
+const uint16_t imageVersion = 1;
+const uint16_t imageCompact = 1;    // the flag
+const uint32_t imageAlignment = 4096;
+
+class Image {
+
+public:
+
+    uint16_t entry = 0;
+    bool compact = false;            // the compact encoding (see instructionWords())
+    std::vector<ImageSegment> segments;
+    int file = -1;                   // the open image file (if it came from one)
+
+    Image() {}
+    ~Image();
+    Image(const Image &) = delete;
+    Image &operator=(const Image &) = delete;
+
+    void addSegment(uint16_t memory, uint16_t address, const std::vector<uint16_t> &words);
+    bool read(const ImageSegment &segment, uint16_t *destination) const;
+    bool save(const std::string &path, std::string &error) const;
+    bool toBytes(std::string &bytes, std::string &error) const;
+    static std::shared_ptr<Image> open(const std::string &path, std::string &error);
+    static std::shared_ptr<Image> fromBytes(const std::string &bytes, std::string &error);
+
+private:
+
+    int readHeader(const uint8_t *header, const std::string &name, std::string &error);
+    bool readSegmentEntry(const uint8_t *entry, uint64_t size, uint16_t s, const std::string &name, std::string &error);
+
+};
+
+uint16_t littleEndian16(const uint8_t *bytes) {
+    return bytes[0] | bytes[1] << 8;
+}
+
+uint32_t littleEndian32(const uint8_t *bytes) {
+    return littleEndian16(bytes) | (uint32_t)littleEndian16(bytes + 2) << 16;
+}
+
+void putLittleEndian16(std::string &bytes, uint16_t v) {
+    bytes += (char)(v & 0xFF);
+    bytes += (char)(v >> 8);
+}
+
+void putLittleEndian32(std::string &bytes, uint32_t v) {
+    putLittleEndian16(bytes, v & 0xFFFF);
+    putLittleEndian16(bytes, v >> 16);
+}
+
+uint64_t littleEndian64(const uint8_t *bytes) {
+    return littleEndian32(bytes) | (uint64_t)littleEndian32(bytes + 4) << 32;
+}
+
+void putLittleEndian64(std::string &bytes, uint64_t v) {
+    putLittleEndian32(bytes, v & 0xFFFFFFFF);
+    putLittleEndian32(bytes, v >> 32);
+}
+
+bool hostIsLittleEndian() {
+    const uint16_t one = 1;
+    return *(const uint8_t *)&one == 1;
+}
+
+Image::~Image() {
+    if (file >= 0)
+        close(file);
+}
+
+void Image::addSegment(uint16_t memory, uint16_t address, const std::vector<uint16_t> &words) {
+    ImageSegment segment;
+    segment.memory = memory;
+    segment.address = address;
+    segment.length = words.size();
+    segment.words = words;
+    segments.push_back(segment);
+}
+
+// copies a segment's data into destination
+bool Image::read(const ImageSegment &segment, uint16_t *destination) const {
+    if (!segment.words.empty() || file < 0) {
+        std::copy(segment.words.begin(), segment.words.end(), destination);
+        return segment.words.size() == segment.length;
+    }
+    size_t bytes = (size_t)segment.length * 2;
+    if (pread(file, destination, bytes, segment.fileOffset) != (ssize_t)bytes)
+        return false;
+    if (!hostIsLittleEndian())
+        for (uint32_t i = 0; i < segment.length; i++)
+            destination[i] = littleEndian16((const uint8_t *)&destination[i]);
+    return true;
+}
+
+// the bytes of the image file save() writes
+bool Image::toBytes(std::string &bytes, std::string &error) const {
+
+    bytes.assign(imageMagic, 4);
+    putLittleEndian16(bytes, imageVersion);
+    putLittleEndian16(bytes, entry);
+    putLittleEndian16(bytes, segments.size());
+    putLittleEndian16(bytes, compact ? imageCompact : 0);
+
+    uint32_t offset = 12 + 12 * segments.size();
+    std::vector<uint32_t> offsets;
+    for (const ImageSegment &segment : segments) {
+        offset = (offset + imageAlignment - 1) / imageAlignment * imageAlignment;
+        offsets.push_back(offset);
+        putLittleEndian16(bytes, segment.memory);
+        putLittleEndian16(bytes, segment.address);
+        putLittleEndian32(bytes, segment.length);
+        putLittleEndian32(bytes, offset);
+        offset += segment.length * 2;
+    }
+
+    for (size_t s = 0; s < segments.size(); s++) {
+        std::vector<uint16_t> words(segments[s].length);
+        if (!read(segments[s], words.data())) {
+            error = "can't read segment " + std::to_string(s);
+            return false;
+        }
+        bytes.resize(offsets[s], '\0');
+        for (uint16_t w : words)
+            putLittleEndian16(bytes, w);
+    }
+
+    return true;
+
+}
+
+bool Image::save(const std::string &path, std::string &error) const {
+
+    std::string bytes;
+    if (!toBytes(bytes, error))
+        return false;
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f || fwrite(bytes.data(), 1, bytes.size(), f) != bytes.size()) {
+        error = "can't write " + path;
+        if (f)
+            fclose(f);
+        return false;
+    }
+    fclose(f);
+    return true;
+
+}
+
+// checks an image file's 12-byte header and reads its entry point and flags,
+// returning how many segments it has (or -1 if it isn't an image this code can load)
+int Image::readHeader(const uint8_t *header, const std::string &name, std::string &error) {
+    if (std::memcmp(header, imageMagic, 4) != 0) {
+        error = name + " isn't an image file";
+        return -1;
+    }
+    if (littleEndian16(header + 4) != imageVersion) {
+        error = name + " has an unknown image version";
+        return -1;
+    }
+    entry = littleEndian16(header + 6);
+    uint16_t flags = littleEndian16(header + 10);
+    if (flags & ~imageCompact) {
+        error = name + " has unknown flags";
+        return -1;
+    }
+    compact = flags & imageCompact;
+    return littleEndian16(header + 8);
+}
+
+// adds segment s from its 12 bytes in the segment table, if its data fits in a file of size bytes
+bool Image::readSegmentEntry(const uint8_t *entry, uint64_t size, uint16_t s, const std::string &name, std::string &error) {
+    ImageSegment segment;
+    segment.memory = littleEndian16(entry);
+    segment.address = littleEndian16(entry + 2);
+    segment.length = littleEndian32(entry + 4);
+    segment.fileOffset = littleEndian32(entry + 8);
+    if (segment.memory > SEGMENT_RAM || segment.address + segment.length > 0x10000
+          || segment.fileOffset + (uint64_t)segment.length * 2 > size) {
+        error = name + " has a bad segment " + std::to_string(s);
+        return false;
+    }
+    segments.push_back(segment);
+    return true;
+}
+
+// reads an image file's header (segment data is read or mapped when the image is loaded)
+std::shared_ptr<Image> Image::open(const std::string &path, std::string &error) {
+
+    std::shared_ptr<Image> image(new Image);
+    image->file = ::open(path.c_str(), O_RDONLY);
+    if (image->file < 0) {
+        error = "can't open " + path;
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(image->file, &info) != 0) {
+        error = "can't stat " + path;
+        return nullptr;
+    }
+
+    uint8_t header[12];
+    if (pread(image->file, header, 12, 0) != 12) {
+        error = path + " isn't an image file";
+        return nullptr;
+    }
+    int count = image->readHeader(header, path, error);
+    if (count < 0)
+        return nullptr;
+
+    std::vector<uint8_t> table(12 * count);
+    if (pread(image->file, table.data(), table.size(), 12) != (ssize_t)table.size()) {
+        error = path + " is cut short";
+        return nullptr;
+    }
+    for (uint16_t s = 0; s < count; s++)
+        if (!image->readSegmentEntry(&table[12 * s], info.st_size, s, path, error))
+            return nullptr;
+    return image;
+
+}
+
+// an image from the bytes of an image file (see toBytes()), with the segments' data copied out of them
+std::shared_ptr<Image> Image::fromBytes(const std::string &bytes, std::string &error) {
+
+    std::shared_ptr<Image> image(new Image);
+    const uint8_t *b = (const uint8_t *)bytes.data();
+    int count = (bytes.size() >= 12) ? image->readHeader(b, "the image", error) : -1;
+    if (count < 0) {
+        if (error.empty())
+            error = "the image isn't an image file";
+        return nullptr;
+    }
+    if (bytes.size() < 12 + 12 * (size_t)count) {
+        error = "the image is cut short";
+        return nullptr;
+    }
+    for (uint16_t s = 0; s < count; s++)
+        if (!image->readSegmentEntry(b + 12 + 12 * s, bytes.size(), s, "the image", error))
+            return nullptr;
+    for (ImageSegment &segment : image->segments) {
+        segment.words.resize(segment.length);
+        for (uint32_t i = 0; i < segment.length; i++)
+            segment.words[i] = littleEndian16(b + segment.fileOffset + 2 * i);
+    }
+    return image;
+
+}
+
+
+
+
+
+/*
+    Besides OUT, a program can talk to devices through memory-mapped I/O (MMIO):
+    a page (256 words) of RAM addresses can be handed to a Device, and then MOV and LD
+    at those addresses call the Device instead of touching RAM[]. Try...
+        ./cpu16 --turbo --devices prog.s
+    which maps the devices below (see "Devices" further down for what each address does)...
+        0xFD00-0xFDFF   DmaDevice     --> copies blocks of RAM in one go
+        0xFE00-0xFEFF   UartDevice    --> reads and writes characters, like a serial console
+        0xFF00-0xFFFF   TimerDevice   --> counts cycles
+
+    Cpu::devicePages[] has an entry for each of the 256 pages, and plain RAM pages have none,
+    so deciding costs one table lookup before MOV or LD go to RAM.
+    Since MOV and LD addresses are part of the instruction, the JIT decides when translating.
+    A Device may read and write cpu.RAM (see PagedRAM), but not the registers (the JIT keeps those elsewhere).
+*/
+
+struct Cpu;
+
+class Device {
+public:
+    virtual ~Device() {}
+    // offset is from the start of where the device is mapped
+    virtual uint16_t read(Cpu &cpu, uint16_t offset) = 0;
+    virtual void write(Cpu &cpu, uint16_t offset, uint16_t value) = 0;
+    // for snapshots (devices with nothing to remember can leave these alone)
+    virtual void saveState(std::string &) const {}
+    virtual void restoreState(const std::string &) {}
+};
+
+struct DevicePage {
+    Device *device = nullptr;   // null for plain RAM
+    uint16_t base = 0;          // the first address the device is mapped at
+};
+
+struct MemoryPage {
+    uint16_t words[256];
+};
+
+// every value devices gave to LD, so running the same instructions again can get the same ones (see TimeMachine)
+struct DeviceReadLog {
+    std::vector<uint16_t> values;
+    size_t next = 0;   // the next one LD gets (when it's values.size(), LD reads the device and saves what it gives)
+};
+
+struct Snapshot;
+
+/*
+    Running a Cpu inside something bigger, like a game loop or a scheduler taking turns with
+    lots of Cpus? Cpu::run() and Cpu::runUntil() run for a time slice, then say why they stopped...
+        cpu.run(10000)                         --> at most 10000 instructions
+        cpu.runUntil(StopWhen().atPC(0x40))    --> until the program counter gets to 0x40
+        cpu.runUntil(StopWhen().onOutput())    --> until just after the next OUT
+        cpu.runUntil(StopWhen().atCycle(cpu.cycles + 5000))
+    Call them again to carry on (even from a breakpoint, or from the pc they stopped at,
+    either of which they step past first).
+*/
+enum RunStatus {
+    RUN_BUDGET,          // ran every instruction it was allowed to
+    RUN_HALTED,          // HLT (or an undefined instruction)
+    RUN_BREAKPOINT,      // about to run an instruction with a breakpoint (see Cpu::setBreakpoint())
+    RUN_REACHED_PC,      // about to run the instruction at StopWhen::pc
+    RUN_OUTPUT,          // just ran an OUT
+    RUN_REACHED_CYCLE    // Cpu::cycles got to StopWhen::cycle
+};
+
+struct StopWhen {
+    int32_t pc = -1;              // -1 for never
+    bool output = false;
+    uint64_t cycle = UINT64_MAX;
+
+    StopWhen &atPC(uint16_t at) { pc = at; return *this; }
+    StopWhen &onOutput() { output = true; return *this; }
+    StopWhen &atCycle(uint64_t at) { cycle = at; return *this; }
+};
+
+
+
+
+
+/*
+    Running thousands of Cpus on the same program? Most of a Cpu's memory would be its own copy
+    of ROM[] and of everything decoded from it (decodedROM[], blockLength[] and blockCycles[]),
+    all the same as every other copy. A SharedROM holds one of each, and any number of Cpus
+    (on any threads) can point at the same one...
+        std::shared_ptr<const SharedROM> rom = SharedROM::make(image, fuseAll, error);
+        cpu.loadImage(image, error, rom);    --> RAM and registers are still cpu's own
+    Nothing ever changes a SharedROM: make() decodes every address ahead of time, so no Cpu
+    has to decode anything while running, and a Cpu that's about to change its ROM
+    (writeROM(), setBreakpoint(), tiered running...) gets its own copy first (see unshareROM()).
+    Translated code doesn't depend on which Cpu it runs on, so Cpus sharing a ROM can share
+    a Jit too, as long as they take turns on one thread (BatchRunner gives each worker its own).
+    Each Cpu that isn't sharing has a SharedROM that's just its own.
+*/
+struct SharedROM {
+    uint16_t words[0x10000];
+    DecodedOp decodedROM[0x10000];
+    uint8_t blockLength[0x10000];
+    uint16_t blockCycles[0x10000];
+    bool compact = false;
+    uint32_t fusions = fuseAll;   // which superinstructions decodedROM[] has
+    uint32_t version = 0;         // the decodedROMVersion of Cpus using it
+    std::vector<uint8_t> tiers;   // each address's Tier, if it was decoded for tiered running
+
+    static std::shared_ptr<const SharedROM> make(const Image &image, uint32_t fusions, std::string &error, bool tiered = false);
+};
+
+/*
+    With tiered running (see Cpu::runTiered()), Cpus sharing a ROM share its tiers too,
+    so a loop that gets hot in one of them gets fused (or translated) for all of them.
+    Since other threads may be running a SharedROM, one still never changes: promoting a loop
+    makes a copy of the TieredROM's current SharedROM with the loop promoted, and makes that
+    the current one. Each Cpu switches to it as its next time slice starts (see Cpu::catchUpTiers()).
+    A promotion that's already in the current one is skipped, so however many Cpus there are,
+    each loop only gets copied for once or twice.
+*/
+struct TieredROM {
+    std::mutex lock;
+    std::shared_ptr<const SharedROM> current;   // (only read or replaced while holding lock)
+};
+
+// every change to any Cpu's decodedROM[] gets a new number, so a Jit shared by Cpus can tell them apart
+uint32_t newROMVersion() {
+    static std::atomic<uint32_t> last{0};
+    return ++last;
+}
+
+
+
+
+
+/*
+    Most programs only ever touch a few hundred words of RAM, so a Cpu's RAM is 256 pages
+    of 256 words, and a page only gets memory of its own the first time it's "touched"...
+        cpu.RAM[a] = 5;          --> touches a's page
+        cpu.RAM.read(a)          --> reads it (an untouched page reads as all 0)
+        cpu.RAM.reset(seed)      --> erases RAM, then randomly sets it, page by page
+    Until then its readPages[] entry points at zeroPage, which every Cpu shares, and its
+    pages[] entry is null. reset() with a seed other than 0 fills each page with random
+    words as it's touched instead (the same words for the same seed, so runs can be repeated),
+    and then reading an untouched page touches it too. Either way, resetting costs the
+    same however much RAM the program used, and a Cpu that used a little RAM only has a little.
+    Deleted pages are kept in a pool for the next page touched (see ramPagePool).
+*/
+const uint16_t zeroPage[256] = {0};
+
+struct PagedRAM {
+    const uint16_t *readPages[256];   // zeroPage (or null, with a seed) until touched
+    uint16_t *pages[256] = {};        // null until touched
+    uint64_t seed = 0;                // 0 for RAM that starts out all 0
+
+    PagedRAM() { reset(); }
+    ~PagedRAM() { reset(); }
+    PagedRAM(const PagedRAM &) = delete;
+    PagedRAM &operator=(const PagedRAM &) = delete;
+
+    uint16_t read(uint16_t address) {
+        const uint16_t *page = readPages[address >> 8];
+        if (!page)
+            page = touch(address >> 8);
+        return page[address & 0xFF];
+    }
+
+    uint16_t &operator[](uint16_t address) {
+        uint16_t *page = pages[address >> 8];
+        if (!page)
+            page = touch(address >> 8);
+        return page[address & 0xFF];
+    }
+
+    bool touched(uint8_t p) const { return pages[p] != nullptr; }
+    uint16_t *touch(uint8_t p);
+    void untouch(uint8_t p);
+    void reset(uint64_t newSeed = 0);
+};
+
+// the pool of pages that untouch() gives back (up to ramPagePoolSize of them)
+const size_t ramPagePoolSize = 16384;
+std::mutex ramPagePoolLock;
+std::vector<uint16_t *> ramPagePool;
+
+// gives page p memory of its own: all 0, or (with a seed) random words that only depend on the seed and p
+uint16_t *PagedRAM::touch(uint8_t p) {
+    if (pages[p])
+        return pages[p];
+    uint16_t *page = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(ramPagePoolLock);
+        if (!ramPagePool.empty()) {
+            page = ramPagePool.back();
+            ramPagePool.pop_back();
+        }
+    }
+    if (!page)
+        page = new uint16_t[256];
+    if (seed) {
+        uint64_t state = seed ^ (0x9E3779B97F4A7C15ull * (p + 1));
+        for (int i = 0; i < 256; i += 4) {
+            // SplitMix64, 4 words at a time
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            z ^= z >> 31;
+            for (int j = 0; j < 4; j++)
+                page[i + j] = (uint16_t)(z >> (16 * j));
+        }
+    } else {
+        std::fill(page, page + 256, 0);
+    }
+    pages[p] = page;
+    readPages[p] = page;
+    return page;
+}
+
+// gives page p's memory back, so it reads as it did right after reset()
+void PagedRAM::untouch(uint8_t p) {
+    uint16_t *page = pages[p];
+    pages[p] = nullptr;
+    readPages[p] = seed ? nullptr : zeroPage;
+    if (!page)
+        return;
+    std::lock_guard<std::mutex> guard(ramPagePoolLock);
+    if (ramPagePool.size() < ramPagePoolSize)
+        ramPagePool.push_back(page);
+    else
+        delete[] page;
+}
+
+// untouches every page (taking the pool's lock just once) and starts using newSeed
+void PagedRAM::reset(uint64_t newSeed) {
+    {
+        std::lock_guard<std::mutex> guard(ramPagePoolLock);
+        for (int p = 0; p < 256; p++) {
+            if (pages[p] && ramPagePool.size() < ramPagePoolSize)
+                ramPagePool.push_back(pages[p]);
+            else
+                delete[] pages[p];
+        }
+    }
+    seed = newSeed;
+    for (int p = 0; p < 256; p++) {
+        pages[p] = nullptr;
+        readPages[p] = seed ? nullptr : zeroPage;
+    }
+}
+
+
+
+
+
+/*
+    Everything about one emulated computer lives in a Cpu: its memory, its registers,
+    and whether it has halted. Make as many of them as you like!
+    They share nothing that changes (see SharedROM), so each one could even run in its own thread.
+    A deleted Cpu's memory is kept in a pool for the next new one (see Cpu::operator new), so
+    making and deleting lots of them doesn't mean getting fresh memory from the operating
+    system (and taking page faults on it) every time.
+*/
+
+class Jit;
+struct Profile;
+class Tracer;
+
+struct Cpu {
+
+    /*
+        ROM is where the program's machine code will be put.
+        Think of it as flash memory that is only written to when a program is assembled.
+        ROM can also contain data used for initializing variables.
+        0x10000 = 2^16 = 65536 is how many addresses 16-bit addresses can address,
+            so no uint16_t address can ever be out of range.
+        I decided to make a uint16_t (instead of a uint8_t) the fundamental memory chunk.
+
+        ROM points at ownROM->words[], unless loadImage() mapped an image file straight into it
+        or gave it a SharedROM. Then change it with writeROM() instead of ROM[i] = ...
+        (a mapped ROM only has romWords words).
+    */
+    std::unique_ptr<SharedROM> ownROM;           // this Cpu's ROM, and what's decoded from it
+    std::shared_ptr<const SharedROM> sharedROM;  // or one shared with other Cpus (if set)
+    uint16_t *ROM = nullptr;
+    uint32_t romWords = 0x10000;
+    void *romMapping = nullptr;
+    size_t romMappingBytes = 0;
+    bool compact = false;   // whether ROM is in the compact encoding (set by loadImage(), see instructionWords())
+
+
+    /*
+        RAM is where the program can read and write.
+        RAM is erased then randomly set whenever the emulated CPU is reset
+            (with RAM.reset(seed), and a new Cpu starts out erased, as if the seed was 0).
+        0x10000 = 2^16 = 65536 is how many addresses 16-bit addresses can address,
+            so no uint16_t address can ever be out of range.
+        I decided to make a uint16_t (instead of a uint8_t) the fundamental memory chunk.
+        Read it with RAM.read(a) and write it with RAM[a] = ... (see PagedRAM).
+    */
+    PagedRAM RAM;
+
+    DevicePage devicePages[256];       // which pages of RAM belong to devices
+
+    /*
+        For snapshots: which pages of RAM and ROM were written since the last snapshot
+        (taken or restored), and what each page held as of then, shared with that snapshot.
+        Anything that changes RAM[] or ROM[] without MOV, writeRAM() or writeROM()
+        must call markRAMDirty() or markROMDirty().
+    */
+    bool ramDirty[256];
+    bool romDirty[256];
+    std::shared_ptr<const MemoryPage> cleanRAM[256], cleanROM[256];
+
+    // MOV and LD go through these, so device pages reach their devices
+    uint16_t readRAM(uint16_t address) {
+        const DevicePage &page = devicePages[address >> 8];
+        if (!page.device)
+            return RAM.read(address);
+        if (!deviceReads)
+            return page.device->read(*this, address - page.base);
+        if (deviceReads->next == deviceReads->values.size())
+            deviceReads->values.push_back(page.device->read(*this, address - page.base));
+        return deviceReads->values[deviceReads->next++];
+    }
+
+    void writeRAM(uint16_t address, uint16_t value) {
+        const DevicePage &page = devicePages[address >> 8];
+        if (page.device) {
+            page.device->write(*this, address - page.base, value);
+        } else {
+            RAM[address] = value;
+            ramDirty[address >> 8] = true;
+        }
+    }
+
+
+    /*
+        Register must be uint16_t since this is a 16-bit computer!
+            reg[0] is program counter
+            reg[1] is flags
+            reg[2] is register 2
+            reg[3] is register 3
+            reg[4] is register 4
+        Feel free to make more registers! No more than 16 for compatibility with my default instruction set.
+        (Compile with -DCPU16_REGISTERS=16 for all of them. See cpuRegisters.)
+
+        All are initialized to 0
+    */
+    uint16_t reg[16] = {0};
+
+    bool halt = false;   // set by HLT (and every undefined instruction)
+    uint64_t cycles = 0;   // the emulated time: how many cycles (see cycleCosts) have run
+
+    // for runUntil(StopWhen().onOutput()): OUT sets halt and pausedOnOutput when stopOnOutput is set
+    bool stopOnOutput = false;
+    bool pausedOnOutput = false;
+
+    /*
+        Breakpoints (for debuggers, see GdbServer) don't cost anything until one is reached:
+        instead of checking a list before every instruction, setBreakpoint() replaces the
+        instruction's DecodedOp with breakpointOp, which stops whatever is running by setting
+        halt and atBreakpoint, without running the instruction (or counting it, or moving reg[0]).
+        To carry on, clear both and run the real instruction with runInstruction().
+    */
+    bool atBreakpoint = false;
+    std::vector<uint16_t> breakpoints;
+
+    /*
+        Lazy flags: most flags that CMP, AND, and OR set are never read before the next one
+        replaces them, so those instructions just save the 2 numbers being compared
+        (AND and OR compare their result to 0) and leave reg[1] alone.
+        A J works out only the flag it reads, with flags().
+        The flag bits get written into reg[1] (settleFlags()) just before an instruction
+        uses register 1, and before any run...() function returns, so from outside a run,
+        reg[1] always holds the right flags.
+    */
+    bool flagsPending = false;
+    uint16_t flagsLeft = 0, flagsRight = 0;
+
+    void compareLater(uint16_t left, uint16_t right) {
+        flagsLeft = left;
+        flagsRight = right;
+        flagsPending = true;
+    }
+
+    // reg[1], with any pending flag bits worked out
+    uint16_t flags() const {
+        if (!flagsPending)
+            return reg[1];
+        return (reg[1] & 0xFFF8) | (flagsLeft > flagsRight) | (flagsLeft == flagsRight) << 1 | (flagsLeft < flagsRight) << 2;
+    }
+
+    void settleFlags() {
+        reg[1] = flags();
+        flagsPending = false;
+    }
+
+    DecodedOp *decodedROM = nullptr;   // in ownROM or sharedROM, like blockLength[] and blockCycles[]
+
+    /*
+        blockLength[pc] is how many instructions run from pc through the next one that ends a
+        "basic block" (see endsBlock()), since nothing in between can jump anywhere,
+        and blockCycles[pc] is how many cycles they take.
+        runThreaded() takes a whole block's instructions out of its budget (and adds its cycles
+        to cycles) when the block starts, instead of counting before every instruction.
+        Blocks over 255 instructions get split, so each length fits a uint8_t.
+    */
+    uint8_t *blockLength = nullptr;
+    uint16_t *blockCycles = nullptr;
+
+    bool decodedROMValid = false;
+    uint32_t decodedROMVersion = 0;   // changes whenever decodedROM[] does (see newROMVersion())
+    uint32_t fusions = fuseAll;       // which superinstructions predecodeROM() uses
+
+    // for tiered running: each address's Tier, and how often each backward J landed there
+    // (both only made when tiered is set, and started over by predecodeROM())
+    std::vector<uint8_t> tiers;
+    std::vector<uint16_t> backEdges;
+    std::shared_ptr<TieredROM> tieredROM;   // where promotions go, when the ROM is a SharedROM
+    uint16_t fuseThreshold = 50;      // how often a loop goes around before it gets superinstructions
+    uint16_t jitThreshold = 1000;     // and before the JIT translates it
+
+    TextSink standardOutput{std::cout};
+    OutputSink *output = &standardOutput;   // where OUT sends values
+    bool useJit = false;
+    bool tiered = false;              // only fuse or JIT hot loops (see runTiered()), instead of everything
+    std::shared_ptr<Jit> jit;         // only made the first time the JIT runs (if nothing gave it one)
+    Profile *profile = nullptr;       // counts what runs, when set
+    Tracer *trace = nullptr;          // records everything that runs, when set
+    DeviceReadLog *deviceReads = nullptr;   // saves (or gives back) what devices give to LD, when set
+
+    Cpu();
+    ~Cpu();
+    Cpu(const Cpu &) = delete;
+    Cpu &operator=(const Cpu &) = delete;
+    static void *operator new(size_t bytes);
+    static void operator delete(void *memory);
+
+    uint16_t readROM(uint32_t i) const;
+    DecodedOp decodeAt(uint16_t pc) const;
+    void writeROM(uint16_t i, uint16_t value);
+    void loadROM(const std::vector<uint16_t> &words, uint16_t start = 0);
+    bool loadImage(const Image &image, std::string &error, std::shared_ptr<const SharedROM> rom = nullptr);
+    bool loadRAMSegment(const Image &image, const ImageSegment &segment);
+    void unshareROM(bool keepDecoded = true);
+    void pointAtROM();
+    bool mapDevice(Device *device, uint16_t address, uint32_t words, std::string &error);
+    void markRAMDirty(uint16_t address, uint32_t words);
+    void markROMDirty(uint16_t address, uint32_t words);
+    void takeSnapshot(Snapshot &snapshot);
+    void restoreSnapshot(const Snapshot &snapshot);
+    void predecodeROM();
+    void decodeAll();
+    void decodeReachable(uint16_t pc);
+    const DecodedOp &decoded(uint16_t pc);
+    void invalidateDecodedROM();
+    bool measureBlock(uint16_t pc);
+    void remeasureBlocks(uint16_t pc);
+    void fuse(uint16_t pc);
+    void promote(uint16_t head, uint16_t jump);
+    void changeTiers(const std::function<bool(const std::vector<uint8_t> &tiers)> &needed, const std::function<void()> &change);
+    void catchUpTiers();
+    void setFusions(uint32_t which);
+    bool isBreakpoint(uint16_t pc) const;
+    void setBreakpoint(uint16_t pc, bool on);
+
+    void execute(const DecodedOp &op);
+    void runInstruction(uint16_t instruction, uint16_t address);
+
+    uint64_t runSwitch(uint64_t count);
+    uint64_t runThreaded(uint64_t count);
+    template <bool COMPACT> uint64_t runThreadedIn(uint64_t count);
+    uint64_t runInterpreter(uint64_t count);
+    bool prepareJit();
+    uint64_t runJit(uint64_t count);
+    uint64_t runTiered(uint64_t count);
+    uint64_t runProfiled(uint64_t count);
+    uint64_t runTraced(uint64_t count);
+    uint64_t runBatch(uint64_t count);
+    RunStatus run(uint64_t maxInstructions);
+    RunStatus runUntil(const StopWhen &when, uint64_t maxInstructions = UINT64_MAX);
+
+};
+
+
+
+
+/*
+    My instructions in machine code will all be 2 uint16_t values...
+      (1) first uint16_t specifies opcode (4 bits) and up to 3 modes, registers, or flags (4 bits each)
+      (2) many instructions will require a uint16_t RAM or ROM address
+    Feel free to change these conventions!
+
+    Assembly code for my instruction set of 4-bit opcodes...
+        0:  ADD A B C    --> add registers A and B; store in register C
+        1:  SUB A B C    --> subtract register B from register A; store in register C
+        2:  NOT A        --> inverts the contents of register A
+        3:  AND A B      --> set flags by comparing (A and B) to 0
+        4:  OR A B       --> set flags by comparing (A or B) to 0
+        5:  CMP A B      --> set flags by comparing registers A to B
+        6:  CPY A B      --> copy register A to B
+        7:  OUT A        --> prints register A
+        8:  MOV A, RAM   --> copy register A to RAM address
+        9:  LD A, RAM    --> copy value in RAM address to register A
+        A:  LDV A, VAL   --> copy value (in ROM) to register A
+        B:
+        C:
+        D:
+        E:  J MODE FLAG, ROM --> jump program counter to ROM address if FLAG is...
+              0  <-- MODE = 0
+              1  <-- MODE = 1
+              either  <-- MODE = 2
+        F:  HLT          --> halt until CPU is reset
+    Feel free to change the above!
+
+    Maybe CMP and OUT commands could have an option to interpret the integers as *signed*?
+    If I didn't want to cast to the int16_t type and just use uint16_t instead... 
+     - ADD and SUB don't need to be changed because two's complement signed integers
+        add and subtract exactly like unsigned integers.
+     - To compare, equality is the same, but comparing numbers with different sign bits is different:
+        the number with the sign bit is always smaller than the other one.
+     - To output a negative number, the sign bit (1) prints a negative sign
+        then (2) prints (32768 - (number in remaining 15 bits))
+
+    To get floating point numbers, half-precision (FP16) is not implemented on modern CPUs,
+    so emulating this would be difficult!
+
+    Examples in assembly code and machine code (* means the nibble is irrelevant)...
+        ADD 2 3 4        --> adds registers 2 and 3 into 4
+            0x0234
+            0x****
+        MOV 4, 0x0000    --> copies register 4 to RAM[0x0000]
+            0x84**
+            0x0000
+        LDV 3, 0x0001    --> copies 0x0001 from ROM into register 3
+            0xA3**
+            0x0001
+        J 1 2, 0x0000    --> sets program counter to 0x0000 if flag register's bit2 is 1
+            0xE12*
+            0x0000
+        HLT
+            0xF***
+            0x****
+
+    If you wanted, you could also create lines of assembly that are not CPU instructions!
+    For example...
+            SET VAL ROM
+    which could store data in ROM at assembly time.
+
+*/
+
+/*
+    How long each instruction takes, in cycles of the emulated CPU's clock: 1 cycle,
+    plus 1 for fetching a second word (LDV's value, and J, MOV, and LD's address),
+    plus 1 for going out to RAM (MOV and LD) or to the outside world (OUT)...
+        ADD AND OR CMP CPY HLT   --> 1
+        LDV J OUT                --> 2
+        MOV LD                   --> 3
+    (Undefined instructions are HLT, so they take 1 too.)
+    Cpu::cycles adds these up as a program runs. The clock (--rate) and TimerDevice both go by
+    Cpu::cycles instead of real time, so a program sees the same timing every time it runs,
+    however fast or busy your computer is. Feel free to change the costs!
+*/
+const uint8_t cycleCosts[16] = { 1, 1, 1, 1, 1, 1, 1, 2, 3, 3, 2, 1, 1, 1, 2, 1 };
+const uint8_t maxCycleCost = 3;
+
+// a breakpoint isn't an instruction, so it takes no time
+uint8_t cycleCost(const DecodedOp &op) {
+    return op.opcode < 16 ? cycleCosts[op.opcode] : 0;
+}
+
+// ROM[] starts out as all HLT
+Cpu::Cpu() : ownROM(new SharedROM) {
+    for (int i=0; i < 0x10000; i++)
+        ownROM->words[i] = 0xFFFF;
+    pointAtROM();
+    markRAMDirty(0, 0x10000);
+    markROMDirty(0, 0x10000);
+}
+
+// the pool of memory that deleted Cpus leave behind (up to cpuPoolSize of them)
+const size_t cpuPoolSize = 64;
+std::mutex cpuPoolLock;
+std::vector<void *> cpuPool;
+
+void *Cpu::operator new(size_t bytes) {
+    if (bytes == sizeof(Cpu)) {
+        std::lock_guard<std::mutex> guard(cpuPoolLock);
+        if (!cpuPool.empty()) {
+            void *memory = cpuPool.back();
+            cpuPool.pop_back();
+            return memory;
+        }
+    }
+    return ::operator new(bytes);
+}
+
+void Cpu::operator delete(void *memory) {
+    {
+        std::lock_guard<std::mutex> guard(cpuPoolLock);
+        if (cpuPool.size() < cpuPoolSize) {
+            cpuPool.push_back(memory);
+            return;
+        }
+    }
+    ::operator delete(memory);
+}
+
+// a mapped ROM[] stops at romWords, so anything past the end reads as HLT
+uint16_t Cpu::readROM(uint32_t i) const {
+    return (i < romWords) ? ROM[i] : 0xFFFF;
+}
+
+// the instruction starting at ROM[pc] (whether or not anything can reach it)
+DecodedOp Cpu::decodeAt(uint16_t pc) const {
+    return decode(readROM(pc), readROM((uint16_t)(pc + 1)), compact);
+}
+
+// points ROM, decodedROM, blockLength and blockCycles at whichever SharedROM this Cpu has
+void Cpu::pointAtROM() {
+    SharedROM *rom = ownROM.get();
+    if (sharedROM)
+        rom = const_cast<SharedROM *>(sharedROM.get());   // (which only the Cpu's own one is)
+    if (!romMapping)
+        ROM = rom->words;
+    decodedROM = rom->decodedROM;
+    blockLength = rom->blockLength;
+    blockCycles = rom->blockCycles;
+}
+
+// goes back to ownROM, copying a mapped image or a SharedROM into it first, so it can be changed
+// (just ROM[] if it's about to be decoded again anyway)
+void Cpu::unshareROM(bool keepDecoded) {
+    if (sharedROM) {
+        if (keepDecoded) {
+            ownROM.reset(new SharedROM(*sharedROM));
+        } else {
+            ownROM.reset(new SharedROM);
+            std::copy(sharedROM->words, sharedROM->words + 0x10000, ownROM->words);
+        }
+        sharedROM.reset();
+        tieredROM.reset();   // (its promotions are this Cpu's own from now on)
+        decodedROMVersion = newROMVersion();   // a Jit shared with the other Cpus can't see this one's changes
+    }
+    if (romMapping) {
+        for (uint32_t i = 0; i < 0x10000; i++)
+            ownROM->words[i] = readROM(i);
+        munmap(romMapping, romMappingBytes);
+        romMapping = nullptr;
+        romWords = 0x10000;
+    }
+    pointAtROM();
+}
+
+// copies a whole program into ROM
+void Cpu::loadROM(const std::vector<uint16_t> &words, uint16_t start) {
+    unshareROM();
+    for (size_t i = 0; i < words.size() && start + i < 0x10000; i++)
+        ROM[start + i] = words[i];
+    markROMDirty(start, words.size());
+    invalidateDecodedROM();
+}
+
+// replaces ROM with the image's, copies its RAM segments, and starts the program counter at its entry point
+// (if rom is set, it's what's in the image's ROM segments, so they're shared instead of copied)
+bool Cpu::loadImage(const Image &image, std::string &error, std::shared_ptr<const SharedROM> rom) {
+
+    if (romMapping) {
+        munmap(romMapping, romMappingBytes);
+        romMapping = nullptr;
+        romWords = 0x10000;
+    }
+    sharedROM = rom;
+    tieredROM.reset();
+    if (rom)
+        ownROM.reset();
+    else if (!ownROM)
+        ownROM.reset(new SharedROM);
+    pointAtROM();
+    invalidateDecodedROM();
+    markRAMDirty(0, 0x10000);
+    markROMDirty(0, 0x10000);
+
+    if (rom) {
+        for (const ImageSegment &segment : image.segments)
+            if (segment.memory == SEGMENT_RAM && !loadRAMSegment(image, segment)) {
+                error = "can't read a segment of the image";
+                return false;
+            }
+        compact = rom->compact;
+        fusions = rom->fusions;
+        decodedROMVersion = rom->version;
+        decodedROMValid = breakpoints.empty();   // otherwise predecodeROM() makes a copy with them in it
+        reg[0] = image.entry;
+        return true;
+    }
+
+    int romSegments = 0;
+    for (const ImageSegment &segment : image.segments)
+        romSegments += (segment.memory == SEGMENT_ROM);
+
+    const ImageSegment *mappable = nullptr;
+    for (const ImageSegment &segment : image.segments)
+        if (romSegments == 1 && segment.memory == SEGMENT_ROM && segment.address == 0 && segment.length > 0
+              && segment.words.empty() && image.file >= 0 && segment.fileOffset % imageAlignment == 0 && hostIsLittleEndian())
+            mappable = &segment;
+
+    if (mappable) {
+        void *memory = mmap(nullptr, mappable->length * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE, image.file, mappable->fileOffset);
+        if (memory != MAP_FAILED) {
+            romMapping = memory;
+            romMappingBytes = mappable->length * 2;
+            ROM = (uint16_t *)memory;
+            romWords = mappable->length;
+        } else {
+            mappable = nullptr;
+        }
+    }
+    if (!mappable)
+        for (int i=0; i < 0x10000; i++)
+            ownROM->words[i] = 0xFFFF;
+
+    for (const ImageSegment &segment : image.segments) {
+        if (&segment == mappable)
+            continue;
+        bool read = (segment.memory == SEGMENT_ROM) ? image.read(segment, ROM + segment.address) : loadRAMSegment(image, segment);
+        if (!read) {
+            error = "can't read a segment of the image";
+            return false;
+        }
+    }
+
+    reg[0] = image.entry;
+    compact = image.compact;
+    return true;
+
+}
+
+// copies one of image's RAM segments into RAM[] (touching only the pages it's on)
+bool Cpu::loadRAMSegment(const Image &image, const ImageSegment &segment) {
+    std::vector<uint16_t> words(segment.length);
+    if (!image.read(segment, words.data()))
+        return false;
+    for (uint32_t i = 0; i < segment.length; i++)
+        RAM[(uint16_t)(segment.address + i)] = words[i];
+    return true;
+}
+
+/*
+    Most of a program's ROM is usually empty (all HLT), so decoding all 65536 addresses would
+    mostly be wasted work. Instead, predecodeROM() only decodes what the program can reach from
+    where it starts, by following each instruction to the next one and each J to where it jumps
+    (both, if it might not jump). Everything else is left as undecodedOp.
+    Some places can't be known ahead of time, like where an ADD into reg[0] goes, or a program
+    counter set from outside (by a debugger, say). So when an undecodedOp is about to run,
+    whatever's reachable from there gets decoded (with decodeReachable()), and the program carries on.
+    That way the interpreter, the JIT, and the lanes only ever decode code that could run.
+
+    The same walk draws the program's control-flow graph: its basic blocks (see endsBlock()),
+    split wherever a jump can land, and where each one can go next. Try...
+        ./cpu16 --cfg prog.s
+*/
+
+// where the program counter can go after op (at pc) runs, returning how many places
+// (or -1 if it can't be known, because op writes reg[0] from a register or RAM)
+int successors(const DecodedOp &op, uint16_t pc, uint16_t next[2]) {
+    if (op.opcode == 0xE) {
+        next[0] = op.address;
+        next[1] = pc + op.words;
+        return (op.a > 1) ? 1 : 2;
+    }
+    if (op.opcode == 0xA && op.a == 0) {
+        next[0] = op.address;
+        return 1;
+    }
+    if (!endsBlock(op)) {
+        next[0] = pc + op.words;
+        return 1;
+    }
+    return (op.opcode == 0x0 || op.opcode == 0x6 || op.opcode == 0x9) ? -1 : 0;   // HLT goes nowhere
+}
+
+struct BasicBlock {
+    uint16_t start;
+    uint32_t length;                    // in instructions
+    std::vector<uint16_t> successors;   // the blocks it can go to next
+    bool indirect;                      // it can also go somewhere that can't be known
+};
+
+// the basic blocks reachable from entry, in order of where they start
+std::vector<BasicBlock> controlFlowGraph(const Cpu &cpu, uint16_t entry) {
+
+    // every reachable instruction, and which of them start a block
+    std::vector<bool> reachable(0x10000), leader(0x10000);
+    std::vector<uint16_t> work(1, entry);
+    leader[entry] = true;
+    while (!work.empty()) {
+        uint16_t pc = work.back();
+        work.pop_back();
+        if (reachable[pc])
+            continue;
+        reachable[pc] = true;
+        DecodedOp op = cpu.decodeAt(pc);
+        uint16_t next[2];
+        for (int i = 0; i < successors(op, pc, next); i++) {
+            leader[next[i]] = leader[next[i]] || endsBlock(op);
+            work.push_back(next[i]);
+        }
+    }
+
+    // each block goes from its first instruction through one that ends a block, or up to another block
+    std::vector<BasicBlock> blocks;
+    for (uint32_t pc = 0; pc < 0x10000; pc++) {
+        if (!leader[pc])
+            continue;
+        BasicBlock block = { (uint16_t)pc, 0, {}, false };
+        for (uint16_t p = pc; ; ) {
+            DecodedOp op = cpu.decodeAt(p);
+            block.length++;
+            if (endsBlock(op) || leader[(uint16_t)(p + op.words)]) {
+                uint16_t next[2];
+                int n = successors(op, p, next);
+                block.successors.assign(next, next + std::max(n, 0));
+                block.indirect = (n < 0);
+                break;
+            }
+            p += op.words;
+        }
+        blocks.push_back(block);
+    }
+    return blocks;
+
+}
+
+void printControlFlowGraph(const std::vector<BasicBlock> &blocks, std::ostream &out) {
+    for (const BasicBlock &block : blocks) {
+        out << "0x" << std::hex << std::setw(4) << std::setfill('0') << block.start << std::dec
+            << "  " << block.length << (block.length == 1 ? " instruction " : " instructions") << "  -->";
+        for (uint16_t next : block.successors)
+            out << " 0x" << std::hex << std::setw(4) << std::setfill('0') << next << std::dec;
+        if (block.indirect)
+            out << " (anywhere)";
+        else if (block.successors.empty())
+            out << " (halts)";
+        out << '\n';
+    }
+}
+
+void Cpu::predecodeROM() {
+    unshareROM(false);
+    if (tiered) {
+        tiers.assign(0x10000, TIER_INTERPRETED);
+        backEdges.assign(0x10000, 0);
+    }
+    else {
+        tiers.clear();
+        backEdges.clear();
+    }
+    std::fill(decodedROM, decodedROM + 0x10000, undecodedOp);
+    std::fill(blockLength, blockLength + 0x10000, 1);
+    std::fill(blockCycles, blockCycles + 0x10000, 0);
+    for (uint16_t pc : breakpoints) {
+        decodedROM[pc] = breakpointOp;
+        fuse(pc);
+    }
+    decodeReachable(reg[0]);
+    decodedROMValid = true;
+    decodedROMVersion = newROMVersion();
+}
+
+// like predecodeROM(), but decodes every address, reachable or not (for a SharedROM)
+void Cpu::decodeAll() {
+    predecodeROM();
+    for (int32_t pc = 0xFFFF; pc >= 0; pc--) {   // from the end, so the block after each one is already measured
+        if (decodedROM[pc].opcode == undecodedOpcode)
+            decodedROM[pc] = decodeAt(pc);
+        measureBlock(pc);
+    }
+    for (uint32_t pc = 0; pc < 0x10000; pc++)
+        fuse(pc);
+}
+
+// decodes image's ROM (with the superinstructions in fusions) into a SharedROM
+// (and with tiered, decodes it for tiered running, with every tier starting out TIER_INTERPRETED)
+std::shared_ptr<const SharedROM> SharedROM::make(const Image &image, uint32_t fusions, std::string &error, bool tiered) {
+    std::unique_ptr<Cpu> scratch(new Cpu);
+    scratch->fusions = fusions;
+    scratch->tiered = tiered;
+    if (!scratch->loadImage(image, error))
+        return nullptr;
+    scratch->decodeAll();
+    std::shared_ptr<SharedROM> rom(std::move(scratch->ownROM));
+    rom->compact = scratch->compact;
+    rom->fusions = fusions;
+    rom->version = scratch->decodedROMVersion;
+    rom->tiers = scratch->tiers;
+    return rom;
+}
+
+// decodes everything reachable from pc that isn't decoded yet
+// (that's only filling in, not a change, so decodedROMVersion stays the same)
+void Cpu::decodeReachable(uint16_t pc) {
+    std::vector<uint16_t> work(1, pc), found;
+    while (!work.empty()) {
+        uint16_t p = work.back();
+        work.pop_back();
+        if (decodedROM[p].opcode != undecodedOpcode)
+            continue;
+        DecodedOp op = decodeAt(p);
+        decodedROM[p] = op;
+        found.push_back(p);
+        uint16_t next[2];
+        for (int i = 0; i < successors(op, p, next); i++)
+            work.push_back(next[i]);
+    }
+    std::sort(found.begin(), found.end(), std::greater<uint16_t>());   // so each block gets measured once
+    for (uint16_t p : found)
+        remeasureBlocks(p);
+}
+
+// decodedROM[pc], decoding it first if it hasn't been
+const DecodedOp &Cpu::decoded(uint16_t pc) {
+    if (decodedROM[pc].opcode == undecodedOpcode)
+        decodeReachable(pc);
+    return decodedROM[pc];
+}
+
+// works out blockLength[pc] and blockCycles[pc] from decodedROM[pc] and the block right after it,
+// returning whether either changed
+bool Cpu::measureBlock(uint16_t pc) {
+    uint8_t length = 1;
+    uint16_t cost = cycleCost(decodedROM[pc]);
+    uint32_t next = pc + decodedROM[pc].words;
+    if (!endsBlock(decodedROM[pc]) && next < 0x10000 && blockLength[next] < 255) {
+        length += blockLength[next];
+        cost += blockCycles[next];
+    }
+    bool changed = length != blockLength[pc] || cost != blockCycles[pc];
+    blockLength[pc] = length;
+    blockCycles[pc] = cost;
+    return changed;
+}
+
+// after decodedROM[pc] changes: measures it and the blocks running into it again, and re-fuses them
+void Cpu::remeasureBlocks(uint16_t pc) {
+    if (!compact) {
+        int32_t p = pc;
+        while (p >= 0 && (measureBlock(p) || p == pc))
+            p -= 2;
+        for (int32_t q = std::max(p - 2, (int32_t)(pc & 1)); q <= pc; q += 2)   // superinstructions start up to 2 instructions before
+            fuse(q);
+        return;
+    }
+    // the instruction before can start 1 or 2 words before, so stop once 2 in a row stay the same
+    int32_t p = pc;
+    for (int unchanged = 0; p >= 0 && unchanged < 2; p--)
+        unchanged = (measureBlock(p) || p == pc) ? 0 : unchanged + 1;
+    for (int32_t q = std::max(p - 3, 0); q <= pc; q++)
+        fuse(q);
+}
+
+// picks the handler for the instruction at pc, which depends on the instructions after it
+// (superinstructions never run past the end of a block, except into their J)
+void Cpu::fuse(uint16_t pc) {
+    DecodedOp &op = decodedROM[pc];
+    const DecodedOp &nextOp = decodedROM[(uint16_t)(pc + op.words)];
+    uint8_t next = nextOp.opcode;
+    uint8_t after = decodedROM[(uint16_t)(pc + op.words + nextOp.words)].opcode;
+    uint8_t length = blockLength[pc];
+    op.handler = op.opcode;
+    if (tiered && !tiers.empty() && op.opcode < 16) {
+        if (tiers[pc] == TIER_JIT_ENTRY) {
+            op.handler = jitEntryHandler;
+            return;
+        }
+        if (op.opcode == 0xE && op.address <= pc) {
+            op.handler = backEdgeHandler;
+            return;
+        }
+    }
+    if (length == 1) {
+        if (op.opcode == 0x0 || (op.opcode >= 0x3 && op.opcode <= 0xA))
+            op.handler = blockEndHandler;
+        return;
+    }
+    if (tiered && !tiers.empty() && tiers[pc] == TIER_INTERPRETED)
+        return;   // no superinstructions until it's hot
+    if (op.opcode == 0x5 && next == 0xE && length == 2 && (fusions & 1 << (SUPER_CMP_J - SUPER_FIRST)))
+        op.handler = SUPER_CMP_J;
+    else if (op.opcode == 0x6 && next == 0x6 && length > 2 && (fusions & 1 << (SUPER_CPY_CPY - SUPER_FIRST)))
+        op.handler = SUPER_CPY_CPY;
+    else if (op.opcode == 0x0 && next == 0x5 && after == 0xE && length == 3 && (fusions & 1 << (SUPER_ADD_CMP_J - SUPER_FIRST)))
+        op.handler = SUPER_ADD_CMP_J;
+}
+
+void Cpu::setFusions(uint32_t which) {
+    if (sharedROM && which != fusions)
+        unshareROM();
+    fusions = which;
+    if (decodedROMValid && !sharedROM)
+        for (uint32_t i = 0; i < 0x10000; i++)
+            fuse(i);
+}
+
+void Cpu::invalidateDecodedROM() {
+    decodedROMValid = false;
+}
+
+bool Cpu::isBreakpoint(uint16_t pc) const {
+    return std::find(breakpoints.begin(), breakpoints.end(), pc) != breakpoints.end();
+}
+
+void Cpu::setBreakpoint(uint16_t pc, bool on) {
+    if (on == isBreakpoint(pc))
+        return;
+    if (on)
+        breakpoints.push_back(pc);
+    else
+        breakpoints.erase(std::find(breakpoints.begin(), breakpoints.end(), pc));
+    if (decodedROMValid) {
+        unshareROM();
+        decodedROM[pc] = on ? breakpointOp : decodeAt(pc);
+        remeasureBlocks(pc);   // a breakpoint ends a block
+        decodedROMVersion = newROMVersion();
+    }
+}
+
+// a ROM word is part of the instruction starting there and the one starting just before it
+void Cpu::writeROM(uint16_t i, uint16_t value) {
+    if (sharedROM || i >= romWords)
+        unshareROM();
+    ROM[i] = value;
+    romDirty[i >> 8] = true;
+    if (decodedROMValid) {
+        decodedROM[i] = isBreakpoint(i) ? breakpointOp : decodeAt(i);
+        decodedROM[(uint16_t)(i-1)] = isBreakpoint(i-1) ? breakpointOp : decodeAt(i - 1);
+        remeasureBlocks(i);
+        remeasureBlocks(i - 1);
+        decodedROMVersion = newROMVersion();
+    }
+}
+
+
+
+void Cpu::execute(const DecodedOp &op) {
+
+    reg[0] += op.words;  // program counter increments to next instruction
+
+    if (op.touchesFlags && flagsPending)
+        settleFlags();
+
+    switch (op.opcode) {
+
+      /* ADD */
+      case 0x0:
+        reg[op.c] = reg[op.a] + reg[op.b];
+        break;
+
+      /* AND, OR, and CMP clear the flags first (which matters when an operand is reg[1]) */
+
+      /* AND */
+      case 0x3:
+        if (op.touchesFlags)
+            reg[1] &= 0xFFF8;
+        compareLater(reg[op.a] & reg[op.b], 0);
+        break;
+
+      /* OR */
+      case 0x4:
+        if (op.touchesFlags)
+            reg[1] &= 0xFFF8;
+        compareLater(reg[op.a] | reg[op.b], 0);
+        break;
+
+      /* CMP */
+      case 0x5:
+        if (op.touchesFlags)
+            reg[1] &= 0xFFF8;
+        compareLater(reg[op.a], reg[op.b]);
+        break;
+
+      /* CPY */
+      case 0x6:
+        reg[op.b] = reg[op.a];
+        break;
+
+      /* OUT */
+      case 0x7:
+        output->write(reg[op.a]);
+        if (stopOnOutput)
+            halt = pausedOnOutput = true;
+        break;
+
+      /* MOV */
+      case 0x8:
+        writeRAM(op.address, reg[op.a]);
+        break;
+
+      /* LD */
+      case 0x9:
+        reg[op.a] = readRAM(op.address);
+        break;
+
+      /* LDV */
+      case 0xA:
+        reg[op.a] = op.address;
+        break;
+
+      /* a breakpoint: stop before the instruction that's really there */
+      case breakpointOpcode:
+        reg[0] -= op.words;
+        halt = atBreakpoint = true;
+        return;
+
+      /* J */
+      case 0xE:
+        if (!op.a) {
+            if (!getbit(flags(), op.b))  reg[0] = op.address;
+        } else if (op.a == 1) {
+            if (getbit(flags(), op.b))  reg[0] = op.address;
+        } else {
+            reg[0] = op.address;
+        }
+        break;
+
+      /* undefined instructions are HLT */
+      default:
+        halt = true;
+        output->flush();
+        break;
+
+    }
+
+    cycles += cycleCosts[op.opcode];   // afterwards, so a device sees when the instruction started
+
+}
+
+// decodes then runs a single instruction (the slow but simple way)
+void Cpu::runInstruction(uint16_t instruction, uint16_t address) {
+    execute( decode(instruction, address, compact) );
+    settleFlags();
+}
+
+// hands words of RAM starting at address to device (or back to RAM, if device is null)
+bool Cpu::mapDevice(Device *device, uint16_t address, uint32_t words, std::string &error) {
+    if (address % 256 || words == 0 || words % 256 || address + words > 0x10000) {
+        error = "devices must be mapped at whole pages (256 words) of RAM";
+        return false;
+    }
+    for (uint32_t page = address >> 8; page < (address + words) >> 8; page++) {
+        devicePages[page].device = device;
+        devicePages[page].base = device ? address : 0;
+    }
+    return true;
+}
+
+
+
+
+
+/*
+    Devices, at their offsets (MOV writes a word to an offset, LD reads one)...
+
+    TimerDevice counts cycles (Cpu::cycles, not real time) since the CPU started (or it was last reset)
+        0   LD: low 16 bits of the count (which also saves the high 16 bits for offset 1)
+            MOV: resets the count to 0
+        1   LD: high 16 bits of the count, as of the last LD from offset 0
+
+    UartDevice is a console for programs that print text instead of numbers
+        0   MOV: prints the low 8 bits as a character
+            LD: the next character typed (waits for it), or 0xFFFF at the end of input
+        1   LD: 1 (ready to print)
+
+    DmaDevice copies lengths of RAM way faster than a loop of LD and MOV
+        0   source address
+        1   destination address
+        2   length (in words)
+        3   MOV: copies length words from source to destination right away
+                 (addresses wrap around past 0xFFFF, and only RAM[] is copied, never devices)
+    All of its offsets can be read back with LD (3 reads as 0, since copies finish instantly).
+*/
+
+class TimerDevice : public Device {
+
+public:
+
+    uint16_t read(Cpu &cpu, uint16_t offset) override {
+        if (offset == 0) {
+            uint64_t count = cpu.cycles - start;
+            high = (count >> 16) & 0xFFFF;
+            return count & 0xFFFF;
+        }
+        return (offset == 1) ? high : 0;
+    }
+
+    void write(Cpu &cpu, uint16_t offset, uint16_t) override {
+        if (offset == 0)
+            start = cpu.cycles;
+    }
+
+    // the snapshot has the Cpu's cycles too, so a restored timer carries on from where it was
+    void saveState(std::string &bytes) const override {
+        putLittleEndian32(bytes, start & 0xFFFFFFFF);
+        putLittleEndian32(bytes, start >> 32);
+        putLittleEndian16(bytes, high);
+    }
+
+    void restoreState(const std::string &bytes) override {
+        if (bytes.size() != 10)
+            return;
+        const uint8_t *b = (const uint8_t *)bytes.data();
+        start = littleEndian32(b) | (uint64_t)littleEndian32(b + 4) << 32;
+        high = littleEndian16(b + 8);
+    }
+
+private:
+
+    uint64_t start = 0;   // the cycle it was reset at
+    uint16_t high = 0;
+
+};
+
+class UartDevice : public Device {
+
+public:
+
+    UartDevice(std::istream &in, std::ostream &out) : in(in), out(out) {}
+    ~UartDevice() { flush(); }
+
+    uint16_t read(Cpu &, uint16_t offset) override {
+        if (offset == 1)
+            return 1;
+        if (offset != 0)
+            return 0;
+        flush();   // so a prompt shows up before waiting for input
+        int c = in.get();
+        return (c == EOF) ? 0xFFFF : (uint8_t)c;
+    }
+
+    void write(Cpu &, uint16_t offset, uint16_t value) override {
+        if (offset != 0)
+            return;
+        if (used == sizeof(buffer))
+            flush();
+        buffer[used++] = (char)value;
+        if ((char)value == '\n')
+            flush();
+    }
+
+    void flush() {
+        out.write(buffer, used);
+        out.flush();
+        used = 0;
+    }
+
+private:
+
+    std::istream &in;
+    std::ostream &out;
+    char buffer[1 << 12];
+    size_t used = 0;
+
+};
+
+class DmaDevice : public Device {
+
+public:
+
+    uint16_t read(Cpu &, uint16_t offset) override {
+        return (offset < 3) ? registers[offset] : 0;
+    }
+
+    void write(Cpu &cpu, uint16_t offset, uint16_t value) override {
+        if (offset < 3)
+            registers[offset] = value;
+        else if (offset == 3)
+            copy(cpu);
+    }
+
+    void saveState(std::string &bytes) const override {
+        for (uint16_t r : registers)
+            putLittleEndian16(bytes, r);
+    }
+
+    void restoreState(const std::string &bytes) override {
+        if (bytes.size() == 6)
+            for (int i = 0; i < 3; i++)
+                registers[i] = littleEndian16((const uint8_t *)bytes.data() + 2 * i);
+    }
+
+private:
+
+    uint16_t registers[3] = {0, 0, 0};   // source, destination, length
+
+    // copies in up to 3 pieces that don't wrap around, each like memmove (backwards when the
+    // destination is after the source), so overlapping copies work
+    void copy(Cpu &cpu) {
+        uint32_t source = registers[0], destination = registers[1], left = registers[2];
+        while (left) {
+            uint32_t n = std::min(left, std::min(0x10000 - source, 0x10000 - destination));
+            if (destination > source)
+                for (uint32_t i = n; i-- > 0; )
+                    cpu.RAM[destination + i] = cpu.RAM.read(source + i);
+            else
+                for (uint32_t i = 0; i < n; i++)
+                    cpu.RAM[destination + i] = cpu.RAM.read(source + i);
+            cpu.markRAMDirty(destination, n);
+            source = (source + n) & 0xFFFF;
+            destination = (destination + n) & 0xFFFF;
+            left -= n;
+        }
+    }
+
+};
+
+
+
+
+
+/*
+    A Snapshot saves everything about a Cpu (registers, halt, RAM, ROM, and the state of each
+    device) so it can go right back to that moment later. Skip a slow warm-up every run...
+        ./cpu16 --snapshot-after 1000000 warm.snap prog.img    --> runs 1000000 instructions, then saves
+        ./cpu16 --turbo --restore warm.snap prog.img            --> starts from there
+
+    Memory is saved in pages of 256 words, and snapshots share the pages they have in common
+    (a page is never changed once it's in a snapshot, so sharing it is safe: copy-on-write).
+    The Cpu remembers which pages were written since its last snapshot (ram/romDirty[]),
+    so taking another one only copies those pages, and restoring one only copies the pages
+    that were written, or that differ from the snapshot. Restoring the same snapshot over and
+    over (like a fuzzer trying lots of inputs from one starting point) is cheap!
+    A restore only makes the JIT start over if ROM changed.
+    Pages of RAM that weren't touched yet (see PagedRAM) are saved as untouchedPage, and
+    restoring one untouches it again, so neither copies anything.
+
+    Device states are saved by where each device is mapped, and restored into whichever
+    device is mapped there then. Which devices are mapped isn't part of a snapshot.
+
+    A snapshot file starts with this header (all numbers are little-endian)...
+        bytes 0-3     "C16S"
+        bytes 4-5     version (4)
+        bytes 6-7     1 if halted, otherwise 0
+        bytes 8-39    reg[0] to reg[15]
+        bytes 40-47   cycles
+        bytes 48-49   number of pages
+        bytes 50-51   number of devices
+    (Version 2 files, from before cycles were counted, don't have bytes 40-47, and
+    version 1 files, from before there could be 16 registers, save only reg[0] to reg[4],
+    so their header is just 22 bytes. They still open, starting from cycle 0.
+    Version 3 and older files leave out RAM pages that are all 0 instead of untouched ones,
+    so those open as all 0.)
+    followed by each page...
+        bytes 0-1     memory it's in (0 for ROM, 1 for RAM)
+        bytes 2-3     page number (its first address / 256)
+        bytes 4-515   its 256 words
+    then each device...
+        bytes 0-1     where it's mapped
+        bytes 2-3     how many bytes of state follow
+    Pages of ROM that are all HLT (0xFFFF) and pages of RAM that weren't touched aren't saved,
+    which keeps files small.
+*/
+
+// a page of RAM that wasn't touched, in a snapshot (it reads as all 0, unless a Cpu's RAM has a seed)
+const std::shared_ptr<const MemoryPage> untouchedPage = std::make_shared<MemoryPage>();
+
+struct Snapshot {
+
+    uint16_t reg[16] = {0};
+    bool halt = false;
+    uint64_t cycles = 0;
+    std::shared_ptr<const MemoryPage> ROM[256], RAM[256];
+    std::vector< std::pair<uint16_t, std::string> > devices;   // where each is mapped, and its saveState()
+
+    bool save(const std::string &path, std::string &error) const;
+    static std::shared_ptr<Snapshot> open(const std::string &path, std::string &error);
+
+};
+
+const char snapshotMagic[4] = { 'C', '1', '6', 'S' };
+const uint16_t snapshotVersion = 4;
+
+void Cpu::markRAMDirty(uint16_t address, uint32_t words) {
+    uint32_t end = std::min<uint32_t>(address + words, 0x10000);
+    for (uint32_t page = address >> 8; (page << 8) < end; page++)
+        ramDirty[page] = true;
+}
+
+void Cpu::markROMDirty(uint16_t address, uint32_t words) {
+    uint32_t end = std::min<uint32_t>(address + words, 0x10000);
+    for (uint32_t page = address >> 8; (page << 8) < end; page++)
+        romDirty[page] = true;
+}
+
+void Cpu::takeSnapshot(Snapshot &snapshot) {
+    for (int p = 0; p < 256; p++) {
+        if (!RAM.touched(p)) {
+            cleanRAM[p] = untouchedPage;
+            ramDirty[p] = false;
+        } else if (ramDirty[p] || !cleanRAM[p]) {
+            std::shared_ptr<MemoryPage> page(new MemoryPage);
+            std::memcpy(page->words, RAM.pages[p], sizeof(page->words));
+            cleanRAM[p] = page;
+            ramDirty[p] = false;
+        }
+        if (romDirty[p] || !cleanROM[p]) {
+            std::shared_ptr<MemoryPage> page(new MemoryPage);
+            for (int i = 0; i < 256; i++)
+                page->words[i] = readROM(256 * p + i);
+            cleanROM[p] = page;
+            romDirty[p] = false;
+        }
+        snapshot.RAM[p] = cleanRAM[p];
+        snapshot.ROM[p] = cleanROM[p];
+    }
+    std::copy(reg, reg + 16, snapshot.reg);
+    snapshot.halt = halt;
+    snapshot.cycles = cycles;
+    snapshot.devices.clear();
+    for (int p = 0; p < 256; p++) {
+        const DevicePage &page = devicePages[p];
+        if (page.device && page.base == 256 * p) {
+            snapshot.devices.push_back(std::make_pair(page.base, std::string()));
+            page.device->saveState(snapshot.devices.back().second);
+        }
+    }
+}
+
+void Cpu::restoreSnapshot(const Snapshot &snapshot) {
+    bool romChanged = false;
+    for (int p = 0; p < 256; p++) {
+        if (snapshot.RAM[p] && (ramDirty[p] || cleanRAM[p] != snapshot.RAM[p])) {
+            if (snapshot.RAM[p] == untouchedPage)
+                RAM.untouch(p);
+            else
+                std::memcpy(RAM.touch(p), snapshot.RAM[p]->words, sizeof(snapshot.RAM[p]->words));
+            cleanRAM[p] = snapshot.RAM[p];
+            ramDirty[p] = false;
+        }
+        if (snapshot.ROM[p] && (romDirty[p] || cleanROM[p] != snapshot.ROM[p])) {
+            bool same = true;   // (then a shared or mapped ROM can stay that way)
+            for (int i = 0; i < 256 && same; i++)
+                same = readROM(256 * p + i) == snapshot.ROM[p]->words[i];
+            if (!same) {
+                if (!romChanged)
+                    unshareROM();
+                romChanged = true;
+                std::memcpy(ROM + 256 * p, snapshot.ROM[p]->words, sizeof(snapshot.ROM[p]->words));
+            }
+            cleanROM[p] = snapshot.ROM[p];
+            romDirty[p] = false;
+        }
+    }
+    if (romChanged)
+        invalidateDecodedROM();
+    std::copy(snapshot.reg, snapshot.reg + 16, reg);
+    halt = snapshot.halt;
+    cycles = snapshot.cycles;
+    for (const std::pair<uint16_t, std::string> &device : snapshot.devices) {
+        const DevicePage &page = devicePages[device.first >> 8];
+        if (page.device && page.base == device.first)
+            page.device->restoreState(device.second);
+    }
+}
+
+bool Snapshot::save(const std::string &path, std::string &error) const {
+
+    std::string pages;
+    uint16_t pageCount = 0;
+    for (uint16_t memory = SEGMENT_ROM; memory <= SEGMENT_RAM; memory++) {
+        for (int p = 0; p < 256; p++) {
+            const MemoryPage *page = (memory == SEGMENT_ROM ? ROM : RAM)[p].get();
+            if (!page || page == untouchedPage.get())
+                continue;
+            if (memory == SEGMENT_ROM && std::all_of(page->words, page->words + 256, [](uint16_t w) { return w == 0xFFFF; }))
+                continue;
+            putLittleEndian16(pages, memory);
+            putLittleEndian16(pages, p);
+            for (uint16_t w : page->words)
+                putLittleEndian16(pages, w);
+            pageCount++;
+        }
+    }
+
+    std::string bytes(snapshotMagic, 4);
+    putLittleEndian16(bytes, snapshotVersion);
+    putLittleEndian16(bytes, halt);
+    for (uint16_t r : reg)
+        putLittleEndian16(bytes, r);
+    putLittleEndian32(bytes, cycles & 0xFFFFFFFF);
+    putLittleEndian32(bytes, cycles >> 32);
+    putLittleEndian16(bytes, pageCount);
+    putLittleEndian16(bytes, devices.size());
+    bytes += pages;
+    for (const std::pair<uint16_t, std::string> &device : devices) {
+        putLittleEndian16(bytes, device.first);
+        putLittleEndian16(bytes, device.second.size());
+        bytes += device.second;
+    }
+
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f || fwrite(bytes.data(), 1, bytes.size(), f) != bytes.size()) {
+        error = "can't write " + path;
+        if (f)
+            fclose(f);
+        return false;
+    }
+    fclose(f);
+    return true;
+
+}
+
+std::shared_ptr<Snapshot> Snapshot::open(const std::string &path, std::string &error) {
+
+    std::ifstream file(path, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    const uint8_t *b = (const uint8_t *)bytes.data();
+    if (!file && !file.eof()) {
+        error = "can't open " + path;
+        return nullptr;
+    }
+    if (bytes.size() < 22 || std::memcmp(b, snapshotMagic, 4) != 0) {
+        error = path + " isn't a snapshot file";
+        return nullptr;
+    }
+    uint16_t version = littleEndian16(b + 4);
+    int registers = (version == 1) ? 5 : 16;
+    size_t at = 12 + 2 * registers + (version >= 3 ? 8 : 0);   // just past the header
+    if (version < 1 || version > snapshotVersion) {
+        error = path + " has an unknown snapshot version";
+        return nullptr;
+    }
+    if (bytes.size() < at) {
+        error = path + " is cut short";
+        return nullptr;
+    }
+
+    std::shared_ptr<Snapshot> snapshot(new Snapshot);
+    snapshot->halt = littleEndian16(b + 6);
+    for (int i = 0; i < registers; i++)
+        snapshot->reg[i] = littleEndian16(b + 8 + 2 * i);
+    if (version >= 3)
+        snapshot->cycles = littleEndian32(b + 40) | (uint64_t)littleEndian32(b + 44) << 32;
+    uint16_t pageCount = littleEndian16(b + at - 4);
+    uint16_t deviceCount = littleEndian16(b + at - 2);
+
+    // pages that weren't saved are all the same, so they share one MemoryPage
+    std::shared_ptr<MemoryPage> hlt(new MemoryPage), zero(new MemoryPage);
+    std::fill(hlt->words, hlt->words + 256, 0xFFFF);
+    std::fill(zero->words, zero->words + 256, 0);
+    std::fill(snapshot->ROM, snapshot->ROM + 256, hlt);
+    if (version >= 4)
+        std::fill(snapshot->RAM, snapshot->RAM + 256, untouchedPage);
+    else
+        std::fill(snapshot->RAM, snapshot->RAM + 256, zero);
+
+    for (uint16_t i = 0; i < pageCount; i++, at += 516) {
+        uint16_t memory = (at + 516 <= bytes.size()) ? littleEndian16(b + at) : 0xFFFF;
+        uint16_t p = (at + 516 <= bytes.size()) ? littleEndian16(b + at + 2) : 0xFFFF;
+        if (memory > SEGMENT_RAM || p > 255) {
+            error = path + " has a bad page " + std::to_string(i);
+            return nullptr;
+        }
+        std::shared_ptr<MemoryPage> page(new MemoryPage);
+        for (int w = 0; w < 256; w++)
+            page->words[w] = littleEndian16(b + at + 4 + 2 * w);
+        (memory == SEGMENT_ROM ? snapshot->ROM : snapshot->RAM)[p] = page;
+    }
+    for (uint16_t i = 0; i < deviceCount; i++) {
+        uint16_t length = (at + 4 <= bytes.size()) ? littleEndian16(b + at + 2) : 0;
+        if (at + 4 + length > bytes.size()) {
+            error = path + " is cut short";
+            return nullptr;
+        }
+        snapshot->devices.push_back(std::make_pair(littleEndian16(b + at), bytes.substr(at + 4, length)));
+        at += 4 + length;
+    }
+    return snapshot;
+
+}
+
+
+
+
+
+/*
+    No more assembling by hand! The Assembler turns assembly code (written like in the
+    comments above) into an Image. Try...
+        ./cpu16 --turbo fib.s                   --> assembles fib.s, then runs it
+        ./cpu16 --save-image fib.img fib.s      --> assembles fib.s into an image file
+
+    Some details...
+     - Registers, modes, and flags are numbers from 0 to 15.
+     - Numbers can be decimal (6) or hexadecimal (0x0006).
+     - Commas are optional, so "LDV 2, 0x0000" and "LDV 2 0x0000" are the same.
+     - A label is a name followed by a colon, like "loop:", and means the address of
+       whatever comes next. Use a label anywhere a ROM address or a value goes,
+       even before the label is defined: "J 1 0, loop"
+     - "SET VAL ROM" stores VAL at ROM address ROM, for data that a program needs.
+     - Everything after a ; is a comment.
+     - The program starts at ROM[0x0000], and each instruction takes 2 uint16_t's.
+       Unused nibbles and unused second uint16_t's are 0.
+     - Unless the program starts with a ".compact" line (comments can come first): then it's in
+       the compact encoding, and instructions that don't use their second uint16_t leave it out.
+
+    It reads the code just once (one "pass"). When a label is used before it's defined,
+    the spot is remembered and filled in ("backpatched") once the label shows up.
+*/
+
+class Assembler {
+
+public:
+
+    // only call these once per Assembler (labels point into source, so keep it around until then)
+    bool assemble(const std::string &source, Image &image, std::string &error);
+    bool assembleFile(const std::string &path, Image &image, std::string &error);
+
+private:
+
+    struct Fixup {
+        uint16_t at;            // the ROM address to fill in
+        std::string_view label;
+        int line;
+    };
+
+    std::vector<uint16_t> words = std::vector<uint16_t>(0x10000, 0xFFFF);
+    uint32_t used = 0;          // one past the highest ROM address written
+    uint32_t pc = 0;
+    bool compact = false;
+    bool started = false;       // whether anything but comments has come yet
+    std::unordered_map<std::string_view, uint16_t> labels;
+    std::vector<Fixup> fixups;
+
+    const char *p = nullptr;    // where the assembler is in the line
+    const char *lineEnd = nullptr;
+    int line = 0;
+    std::string error;
+
+    bool fail(const std::string &message);
+    void skipSpaces();
+    bool atEnd();
+    std::string_view word();
+    bool number(std::string_view text, uint32_t &value);
+    bool nibble(uint16_t &value);
+    bool value(std::string_view text, uint16_t at);
+    bool emit(uint16_t at, uint16_t w);
+    bool instruction(std::string_view mnemonic);
+
+};
+
+bool Assembler::fail(const std::string &message) {
+    error = "line " + std::to_string(line) + ": " + message;
+    return false;
+}
+
+void Assembler::skipSpaces() {
+    while (p < lineEnd && (*p == ' ' || *p == '\t' || *p == ',' || *p == '\r'))
+        p++;
+}
+
+bool Assembler::atEnd() {
+    skipSpaces();
+    return p == lineEnd || *p == ';';
+}
+
+// the next name or number on the line
+std::string_view Assembler::word() {
+    skipSpaces();
+    const char *start = p;
+    while (p < lineEnd && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_' || *p == '.'))
+        p++;
+    return std::string_view(start, p - start);
+}
+
+bool Assembler::number(std::string_view text, uint32_t &value) {
+    if (text.empty() || text[0] < '0' || text[0] > '9')
+        return false;
+    bool hex = text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X');
+    value = 0;
+    for (size_t i = hex ? 2 : 0; i < text.size(); i++) {
+        int digit;
+        char ch = text[i] | 0x20;   // lowercase
+        if (ch >= '0' && ch <= '9')
+            digit = ch - '0';
+        else if (hex && ch >= 'a' && ch <= 'f')
+            digit = ch - 'a' + 10;
+        else
+            return false;
+        value = value * (hex ? 16 : 10) + digit;
+        if (value > 0xFFFF)
+            return false;
+    }
+    return true;
+}
+
+bool Assembler::nibble(uint16_t &value) {
+    std::string_view text = word();
+    uint32_t v;
+    if (!number(text, v) || v > 0xF)
+        return fail("expected a number from 0 to 15, not \"" + std::string(text) + "\"");
+    value = v;
+    return true;
+}
+
+// a number or a label, stored at ROM[at]
+bool Assembler::value(std::string_view text, uint16_t at) {
+    if (text.empty())
+        return fail("expected a value or a label");
+    uint32_t v;
+    if (number(text, v))
+        return emit(at, v);
+    if (std::isdigit((unsigned char)text[0]))
+        return fail("\"" + std::string(text) + "\" isn't a 16-bit number");
+    std::unordered_map<std::string_view, uint16_t>::const_iterator label = labels.find(text);
+    if (label != labels.end())
+        return emit(at, label->second);
+    Fixup fixup = { at, text, line };
+    fixups.push_back(fixup);
+    return emit(at, 0);
+}
+
+bool Assembler::emit(uint16_t at, uint16_t w) {
+    words[at] = w;
+    used = std::max(used, (uint32_t)at + 1);
+    return true;
+}
+
+bool Assembler::instruction(std::string_view mnemonic) {
+
+    // opcode, how many nibbles follow it, and whether there's a second uint16_t to fill in
+    static const struct { const char *name; uint16_t opcode; int nibbles; bool address; } table[] = {
+        { "ADD", 0x0, 3, false },   { "SUB", 0x1, 3, false },   { "NOT", 0x2, 1, false },
+        { "AND", 0x3, 2, false },   { "OR",  0x4, 2, false },   { "CMP", 0x5, 2, false },
+        { "CPY", 0x6, 2, false },   { "OUT", 0x7, 1, false },   { "MOV", 0x8, 1, true },
+        { "LD",  0x9, 1, true },    { "LDV", 0xA, 1, true },    { "J",   0xE, 2, true },
+        { "HLT", 0xF, 0, false },
+    };
+
+    if (mnemonic == ".compact") {
+        if (started)
+            return fail(".compact must come before everything else");
+        compact = true;
+        return true;
+    }
+
+    char upper[4] = {0, 0, 0, 0};
+    if (mnemonic.size() > 3)
+        return fail("unknown instruction \"" + std::string(mnemonic) + "\"");
+    for (size_t i = 0; i < mnemonic.size(); i++)
+        upper[i] = mnemonic[i] & ~0x20;   // uppercase
+
+    if (std::strcmp(upper, "SET") == 0) {
+        std::string_view val = word();
+        std::string_view rom = word();
+        uint32_t address;
+        if (!number(rom, address) || address >= 0x10000)
+            return fail("SET needs a ROM address, not \"" + std::string(rom) + "\"");
+        return value(val, address);
+    }
+
+    for (const auto &entry : table) {
+        if (std::strcmp(upper, entry.name) != 0)
+            continue;
+        uint16_t n[3] = {0, 0, 0};
+        for (int i = 0; i < entry.nibbles; i++)
+            if (!nibble(n[i]))
+                return false;
+        uint8_t words = instructionWords(entry.opcode, compact);
+        if (pc + words > 0x10000)
+            return fail("ROM is full");
+        emit(pc, entry.opcode << 12 | n[0] << 8 | n[1] << 4 | n[2]);
+        if (words == 2)
+            emit(pc + 1, 0);
+        if (entry.address && !value(word(), pc + 1))
+            return false;
+        pc += words;
+        return true;
+    }
+
+    return fail("unknown instruction \"" + std::string(mnemonic) + "\"");
+
+}
+
+bool Assembler::assemble(const std::string &source, Image &image, std::string &errorMessage) {
+
+    const char *text = source.data();
+    const char *textEnd = text + source.size();
+
+    while (text < textEnd) {
+
+        line++;
+        p = text;
+        lineEnd = (const char *)std::memchr(text, '\n', textEnd - text);
+        if (!lineEnd)
+            lineEnd = textEnd;
+        text = lineEnd + 1;
+
+        while (!atEnd()) {
+            std::string_view name = word();
+            if (name.empty()) {
+                fail(std::string("unexpected \"") + *p + "\"");
+                break;
+            }
+            if (p < lineEnd && *p == ':') {
+                p++;
+                started = true;
+                if (!labels.emplace(name, pc).second) {
+                    fail("label \"" + std::string(name) + "\" is defined twice");
+                    break;
+                }
+                continue;
+            }
+            if (instruction(name) && !atEnd())
+                fail("too much on this line");
+            started = true;
+            break;
+        }
+        if (!error.empty())
+            break;
+
+    }
+
+    for (size_t i = 0; i < fixups.size() && error.empty(); i++) {
+        std::unordered_map<std::string_view, uint16_t>::const_iterator label = labels.find(fixups[i].label);
+        line = fixups[i].line;
+        if (label == labels.end())
+            fail("label \"" + std::string(fixups[i].label) + "\" is never defined");
+        else
+            words[fixups[i].at] = label->second;
+    }
+
+    if (!error.empty()) {
+        errorMessage = error;
+        return false;
+    }
+    image.entry = 0;
+    image.compact = compact;
+    image.segments.clear();
+    image.addSegment(SEGMENT_ROM, 0, std::vector<uint16_t>(words.begin(), words.begin() + used));
+    return true;
+
+}
+
+bool Assembler::assembleFile(const std::string &path, Image &image, std::string &errorMessage) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        errorMessage = "can't open " + path;
+        return false;
+    }
+    std::ostringstream source;
+    source << file.rdbuf();
+    if (!assemble(source.str(), image, errorMessage)) {
+        errorMessage = path + ", " + errorMessage;
+        return false;
+    }
+    return true;
+}
+
+
+
+
+
+/*
+    The clock decides how fast the emulated CPU runs. Choose it when running this code...
+        ./cpu16              --> the default rate of one cycle per 50 ms
+        ./cpu16 --turbo      --> no waiting at all: run as fast as your computer can
+        ./cpu16 --rate 1M    --> aim for a rate in cycles per second (k and M suffixes work)
+        ./cpu16 --step       --> print the registers, then wait for Enter before each instruction
+                                 (or another command, like going back: see TimeMachine)
+
+    The rate is in cycles (see cycleCosts), so an LD takes longer than an ADD, just like the
+    program itself sees with TimerDevice.
+    Sleeping after every instruction would take way longer than the instruction itself,
+    so a fixed rate is done in batches: run about a millisecond's worth of cycles,
+    then sleep until a monotonic clock says that the batch should have finished.
+    Slowing the CPU way down is still fun for watching it work!
+*/
+
+enum ClockMode { CLOCK_TURBO, CLOCK_RATE, CLOCK_STEP };
+
+struct Clock {
+    ClockMode mode = CLOCK_RATE;
+    double cyclesPerSecond = 1000.0 / defaultMillisecondsPerCycle;
+};
+
+void printRegisters(const Cpu &cpu) {
+    for (int i = 0; i < cpuRegisters; i++)
+        std::cout << cpu.reg[i] << (i + 1 < cpuRegisters ? ' ' : '\n');
+    std::cout << std::flush;
+}
+
+/*
+    There are 2 ways to run the decoded instructions...
+      (1) a plain switch inside a loop, which any C++ compiler can build
+      (2) "threaded" dispatch, where every instruction's code jumps straight to the code of
+          the next instruction using GCC and Clang's labels-as-values (goto *pointer).
+          This skips the trip back to the top of a loop, and each instruction gets its own
+          indirect jump, so your CPU's branch predictor learns which instruction usually follows it.
+    Threaded dispatch is used whenever the compiler supports it.
+    Compile with -DCPU16_DISPATCH_SWITCH to use the switch anyway.
+
+    Both return how many instructions ran before the batch ended or the CPU halted.
+*/
+
+#if defined(__GNUC__) && !defined(CPU16_DISPATCH_SWITCH)
+#define CPU16_THREADED
+#endif
+
+uint64_t Cpu::runSwitch(uint64_t count) {
+    if (!decodedROMValid)
+        predecodeROM();
+    uint64_t i = 0;
+    for (; i < count && !halt; i++)
+        execute( decoded(reg[0]) );
+    if (atBreakpoint && i > 0)
+        i--;   // the breakpoint itself wasn't an instruction
+    settleFlags();
+    return i;
+}
+
+#ifdef CPU16_THREADED
+
+// the program counter moving by a constant 2 doesn't have to wait for each DecodedOp to load,
+// so the usual encoding gets its own copy of the loop
+uint64_t Cpu::runThreaded(uint64_t count) {
+    return compact ? runThreadedIn<true>(count) : runThreadedIn<false>(count);
+}
+
+template <bool COMPACT>
+uint64_t Cpu::runThreadedIn(uint64_t count) {
+
+    static const void *handlers[jitEntryHandler + 1] = {
+        &&ADD, &&HLT, &&HLT, &&AND, &&OR,  &&CMP, &&CPY, &&OUT,
+        &&MOV, &&LD,  &&LDV, &&HLT, &&HLT, &&HLT, &&J,   &&HLT,
+        &&CMP_J, &&CPY_CPY, &&ADD_CMP_J,
+        &&BREAKPOINT, &&BLOCK_END, &&UNDECODED, &&BACK_EDGE, &&JIT_ENTRY
+    };
+
+    if (!decodedROMValid)
+        predecodeROM();
+    if (halt || count == 0)
+        return 0;
+
+    uint64_t remaining = count;
+    const DecodedOp *op;
+    // (the tables may be shared with other Cpus, so copies of the pointers to them stay in registers)
+    DecodedOp *const decodedROM = this->decodedROM;
+    const uint8_t *const blockLength = this->blockLength;
+    const uint16_t *const blockCycles = this->blockCycles;
+
+    // the program counter increments to the next instruction before each one runs
+    #define FETCH()     op = &decodedROM[reg[0]];  reg[0] += COMPACT ? op->words : 2;  if (op->touchesFlags && flagsPending) settleFlags()
+    #define DISPATCH()  FETCH();  goto *handlers[op->handler]
+    #define NEXT()      DISPATCH()
+
+    // each block's instructions come out of the budget, and its cycles go into cycles, when it starts
+    // (the rest of a batch too short for the next block runs in runSwitch())
+    #define NEXT_BLOCK()  if (blockLength[reg[0]] > remaining) goto tail;  \
+                          remaining -= blockLength[reg[0]];  cycles += blockCycles[reg[0]];  DISPATCH()
+
+    NEXT_BLOCK();
+
+  ADD:
+    reg[op->c] = reg[op->a] + reg[op->b];
+    NEXT();
+
+  // like execute(), the flags are cleared first (which matters when an operand is reg[1])
+
+  AND:
+    if (op->touchesFlags)
+        reg[1] &= 0xFFF8;
+    compareLater(reg[op->a] & reg[op->b], 0);
+    NEXT();
+
+  OR:
+    if (op->touchesFlags)
+        reg[1] &= 0xFFF8;
+    compareLater(reg[op->a] | reg[op->b], 0);
+    NEXT();
+
+  CMP:
+    if (op->touchesFlags)
+        reg[1] &= 0xFFF8;
+    compareLater(reg[op->a], reg[op->b]);
+    NEXT();
+
+  CPY:
+    reg[op->b] = reg[op->a];
+    NEXT();
+
+  OUT:
+    output->write(reg[op->a]);
+    if (stopOnOutput) {
+        halt = pausedOnOutput = true;
+        remaining += blockLength[reg[0]];   // the rest of the block won't run after all
+        cycles -= blockCycles[reg[0]];
+        goto done;
+    }
+    NEXT();
+
+  MOV:
+    if (devicePages[op->address >> 8].device)
+        goto DEVICE;
+    RAM[op->address] = reg[op->a];
+    ramDirty[op->address >> 8] = true;
+    NEXT();
+
+  LD:
+    if (devicePages[op->address >> 8].device)
+        goto DEVICE;
+    reg[op->a] = RAM.read(op->address);
+    NEXT();
+
+  // a device sees cycles as of when the instruction starts, not with the rest of the block added
+  DEVICE:
+    cycles -= blockCycles[(uint16_t)(reg[0] - op->words)];
+    reg[0] -= op->words;
+    execute(*op);
+    cycles += blockCycles[reg[0]];
+    NEXT();
+
+  LDV:
+    reg[op->a] = op->address;
+    NEXT();
+
+  J:
+    if (op->a > 1 || (bool)getbit(flags(), op->b) == (bool)op->a)
+        reg[0] = op->address;
+    NEXT_BLOCK();
+
+  // any other instruction ending a block (like one writing reg[0]) is rare, so execute() runs it
+  BLOCK_END:
+    reg[0] -= op->words;
+    cycles -= cycleCosts[op->opcode];   // execute() adds them again
+    execute(*op);
+    if (halt)
+        goto done;
+    NEXT_BLOCK();
+
+  // superinstructions, which run as many instructions as their names say
+  // (all inside one block, so the budget already has room for them)
+
+  CMP_J:
+    if (op->touchesFlags)
+        reg[1] &= 0xFFF8;
+    compareLater(reg[op->a], reg[op->b]);
+    FETCH();
+    if (op->a > 1 || (bool)getbit(flags(), op->b) == (bool)op->a) {
+        reg[0] = op->address;
+        if (op->handler == backEdgeHandler)
+            goto BACK_EDGE_TAKEN;
+    }
+    NEXT_BLOCK();
+
+  CPY_CPY:
+    reg[op->b] = reg[op->a];
+    FETCH();
+    reg[op->b] = reg[op->a];
+    NEXT();
+
+  ADD_CMP_J:
+    reg[op->c] = reg[op->a] + reg[op->b];
+    FETCH();
+    goto CMP_J;
+
+  BREAKPOINT:
+    reg[0] -= op->words;
+    halt = atBreakpoint = true;
+    remaining++;   // it was in its block's budget, but isn't an instruction
+    goto done;
+
+  // tiered running: count how often each loop goes around, to find the hot ones
+
+  BACK_EDGE:
+    if (op->a > 1 || (bool)getbit(flags(), op->b) == (bool)op->a) {
+        reg[0] = op->address;
+        goto BACK_EDGE_TAKEN;
+    }
+    NEXT_BLOCK();
+
+  BACK_EDGE_TAKEN:
+    if (tiered && (++backEdges[reg[0]] == fuseThreshold || backEdges[reg[0]] == jitThreshold))
+        promote(reg[0], op - decodedROM);
+    NEXT_BLOCK();
+
+  // runTiered() hands this loop to the JIT (anything else just runs the instruction)
+  JIT_ENTRY:
+    reg[0] -= op->words;
+    remaining += blockLength[reg[0]];   // the rest of the block won't run here after all
+    cycles -= blockCycles[reg[0]];
+    if (tiered)
+        goto done;
+    execute(*op);
+    remaining--;
+    if (halt)
+        goto done;
+    NEXT_BLOCK();
+
+  UNDECODED:
+    reg[0] -= op->words;
+    remaining++;   // like a breakpoint, it isn't an instruction
+    decodeReachable(reg[0]);
+    NEXT_BLOCK();
+
+  HLT:
+    halt = true;
+    output->flush();
+    goto done;
+
+  tail:
+    remaining -= runSwitch(remaining);
+
+  done:
+    #undef FETCH
+    #undef NEXT
+    #undef NEXT_BLOCK
+    #undef DISPATCH
+    settleFlags();
+    return count - remaining;
+
+}
+
+#endif
+
+uint64_t Cpu::runInterpreter(uint64_t count) {
+#ifdef CPU16_THREADED
+    return runThreaded(count);
+#else
+    return runSwitch(count);
+#endif
+}
+
+
+
+
+
+/*
+    Want to know what your program spends its time doing? Run it with a Profile...
+        ./cpu16 --turbo --profile profile.json    (or profile.csv)
+    which counts...
+        instructions    --> how many instructions ran
+        opcodes         --> how many times each opcode ran
+        jumps           --> how many J instructions jumped (taken) or didn't (not taken)
+        pairs           --> how many times each opcode ran right after the instruction before it
+                            in ROM (without a jump in between), which is what fusions() looks at
+        addresses       --> how many times the instruction at each ROM address ran,
+                            which shows you your program's hot loops
+        seconds         --> how long your computer took, so you can tell whether a slow
+                            program is running lots of instructions or each one is slow
+    Profiling runs through runProfiled(), an extra-careful version of the switch,
+    so it's only slower while a Cpu's profile is set (even with --jit).
+    Compile with -DCPU16_NO_PROFILE to leave profiling out completely.
+*/
+
+const char *opcodeNames[16] = {
+    "ADD", "SUB", "NOT", "AND", "OR", "CMP", "CPY", "OUT",
+    "MOV", "LD", "LDV", "B", "C", "D", "J", "HLT"
+};
+
+struct Profile {
+
+    uint64_t instructions = 0;
+    uint64_t opcodes[16] = {0};
+    uint64_t jumpsTaken = 0;
+    uint64_t jumpsNotTaken = 0;
+    uint64_t pairs[16][16] = {{0}};   // pairs[first][second]
+    std::vector<uint64_t> addressHits = std::vector<uint64_t>(0x10000);
+    double seconds = 0;
+
+    void add(const Profile &other) {
+        instructions += other.instructions;
+        for (int i = 0; i < 16; i++)
+            opcodes[i] += other.opcodes[i];
+        for (int i = 0; i < 16; i++)
+            for (int j = 0; j < 16; j++)
+                pairs[i][j] += other.pairs[i][j];
+        jumpsTaken += other.jumpsTaken;
+        jumpsNotTaken += other.jumpsNotTaken;
+        for (uint32_t i = 0; i < 0x10000; i++)
+            addressHits[i] += other.addressHits[i];
+        seconds += other.seconds;
+    }
+
+    void writeJSON(std::ostream &stream) const {
+        stream << "{\n  \"instructions\": " << instructions << ",\n  \"seconds\": " << seconds << ",\n  \"opcodes\": {";
+        for (int i = 0; i < 16; i++)
+            stream << (i ? ", " : " ") << '"' << opcodeNames[i] << "\": " << opcodes[i];
+        stream << " },\n  \"jumps\": { \"taken\": " << jumpsTaken << ", \"notTaken\": " << jumpsNotTaken << " },\n  \"pairs\": {";
+        bool first = true;
+        for (int i = 0; i < 16; i++)
+            for (int j = 0; j < 16; j++)
+                if (pairs[i][j]) {
+                    stream << (first ? " " : ", ") << '"' << opcodeNames[i] << ' ' << opcodeNames[j] << "\": " << pairs[i][j];
+                    first = false;
+                }
+        stream << " },\n  \"addresses\": [";
+        first = true;
+        for (uint32_t i = 0; i < 0x10000; i++) {
+            if (!addressHits[i])
+                continue;
+            stream << (first ? "\n" : ",\n") << "    { \"address\": " << i << ", \"hits\": " << addressHits[i] << " }";
+            first = false;
+        }
+        stream << "\n  ]\n}\n";
+    }
+
+    void writeCSV(std::ostream &stream) const {
+        stream << "kind,name,count\n";
+        stream << "instructions,," << instructions << "\n";
+        stream << "seconds,," << seconds << "\n";
+        for (int i = 0; i < 16; i++)
+            stream << "opcode," << opcodeNames[i] << ',' << opcodes[i] << "\n";
+        stream << "jump,taken," << jumpsTaken << "\n";
+        stream << "jump,notTaken," << jumpsNotTaken << "\n";
+        for (int i = 0; i < 16; i++)
+            for (int j = 0; j < 16; j++)
+                if (pairs[i][j])
+                    stream << "pair," << opcodeNames[i] << ' ' << opcodeNames[j] << ',' << pairs[i][j] << "\n";
+        for (uint32_t i = 0; i < 0x10000; i++)
+            if (addressHits[i])
+                stream << "address," << i << ',' << addressHits[i] << "\n";
+    }
+
+    // the superinstructions (as Cpu::fusions bits) whose runs make up at least share of what ran
+    uint32_t fusions(double share = 0.01) const {
+        uint64_t least = std::max<uint64_t>(1, instructions * share);
+        uint32_t which = 0;
+        if (pairs[0x5][0xE] >= least)
+            which |= 1 << (SUPER_CMP_J - SUPER_FIRST);
+        if (pairs[0x6][0x6] >= least)
+            which |= 1 << (SUPER_CPY_CPY - SUPER_FIRST);
+        if (std::min(pairs[0x0][0x5], pairs[0x5][0xE]) >= least)
+            which |= 1 << (SUPER_ADD_CMP_J - SUPER_FIRST);
+        return which;
+    }
+
+};
+
+#ifndef CPU16_NO_PROFILE
+
+uint64_t Cpu::runProfiled(uint64_t count) {
+    if (!decodedROMValid)
+        predecodeROM();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t i = 0;
+    uint16_t fallThrough = 0;   // where the instruction before would have gone without jumping
+    int previousOpcode = -1;
+    for (; i < count && !halt; i++) {
+        const DecodedOp &op = decoded(reg[0]);
+        if (op.opcode == breakpointOpcode) {
+            execute(op);
+            break;
+        }
+        profile->addressHits[reg[0]]++;
+        profile->opcodes[op.opcode]++;
+        if (previousOpcode >= 0 && fallThrough == reg[0])
+            profile->pairs[previousOpcode][op.opcode]++;
+        fallThrough = reg[0] + op.words;
+        previousOpcode = op.opcode;
+        if (op.opcode == 0xE && op.a <= 1) {
+            if ((bool)getbit(flags(), op.b) == (bool)op.a)
+                profile->jumpsTaken++;
+            else
+                profile->jumpsNotTaken++;
+        } else if (op.opcode == 0xE) {
+            profile->jumpsTaken++;
+        }
+        execute(op);
+    }
+    settleFlags();
+    profile->instructions += i;
+    profile->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return i;
+}
+
+#endif
+
+// for --fuse profile: runs image for a while on a scratch Cpu (with no devices, and OUT thrown away)
+// and picks superinstructions from what ran
+uint32_t profileFusions(const Image &image, uint64_t instructions) {
+#ifndef CPU16_NO_PROFILE
+    std::unique_ptr<Cpu> scratch(new Cpu);
+    std::string error;
+    if (!scratch->loadImage(image, error))
+        return fuseAll;
+    std::ostream nowhere(nullptr);
+    TextSink discard(nowhere);
+    Profile profile;
+    scratch->output = &discard;
+    scratch->profile = &profile;
+    scratch->runProfiled(instructions);
+    return profile.fusions();
+#else
+    (void)image;
+    (void)instructions;
+    return fuseAll;
+#endif
+}
+
+
+
+
+
+/*
+    Want a record of everything a program did, instruction by instruction?  Run it with a Tracer...
+        ./cpu16 --turbo --trace run.trace prog.s
+        ./cpu16 --read-trace run.trace            --> prints the trace as text
+    Printing text for every instruction would take far longer than running it, so a trace is
+    saved in a compact binary format instead, and written to the file by a background thread
+    while the program keeps running: runTraced() puts each instruction's record into a ring buffer,
+    and the writer thread takes records out and writes them.
+    With just 1 thread putting in and 1 taking out, the ring needs no locks, just 2 atomic counters
+    (how many bytes were put in, and how many were taken out).
+    If the writer falls behind and the ring fills up, the program waits for it, so nothing is lost.
+
+    A trace file starts with this header (all numbers are little-endian)...
+        bytes 0-3     "C16T"
+        bytes 4-5     version (2)
+        bytes 6-7     how many registers there are (cpuRegisters)
+        bytes 8-39    reg[0] to reg[15] when tracing started
+        bytes 40-41   flags: bit 0 is 1 if ROM is in the compact encoding (version 1 traces stop at byte 39)
+    and each instruction that ran is 1 "tag" byte, then whatever its tag's bits say follows...
+        bit 0 --> its address (2 bytes), unless it's right after the instruction before it
+        bit 1 --> its 2 ROM words (4 bytes), unless they're the same as the last time it ran there
+        bit 2 --> a register it changed (bits 4-7 of the tag say which), and its new value (2 bytes)
+        bit 3 --> a RAM (or device) address it wrote, and the value (4 bytes)
+    in that order. A loop's instructions are mostly 1 or 3 bytes each!
+    The reader keeps track of the same things to work out everything that's left out.
+    Like profiling, tracing runs through its own version of the switch, so it's slower than
+    other ways of running (even with --jit), but not by that much.
+*/
+
+const char traceMagic[4] = { 'C', '1', '6', 'T' };
+const uint16_t traceVersion = 2;
+
+class Tracer {
+
+public:
+
+    ~Tracer() {
+        close();
+    }
+
+    // writes the header for a trace starting from cpu's state, then starts the writer thread
+    bool open(const std::string &path, const Cpu &cpu, std::string &error) {
+        file = fopen(path.c_str(), "wb");
+        if (!file) {
+            error = "can't write " + path;
+            return false;
+        }
+        std::string header(traceMagic, 4);
+        putLittleEndian16(header, traceVersion);
+        putLittleEndian16(header, cpuRegisters);
+        for (int r = 0; r < 16; r++) {
+            registers[r] = (r == 1) ? cpu.flags() : cpu.reg[r];
+            putLittleEndian16(header, registers[r]);
+        }
+        putLittleEndian16(header, cpu.compact ? imageCompact : 0);
+        fwrite(header.data(), 1, header.size(), file);
+        nextPc = cpu.reg[0];
+        lastWords.assign(0x10000, ~(uint64_t)0);
+        ring.reset(new uint8_t[ringSize]);
+        writer = std::thread(&Tracer::writeLoop, this);
+        return true;
+    }
+
+    // waits for everything to be written, then closes the file (false if writing failed)
+    bool close() {
+        if (!file)
+            return true;
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+        bool ok = !failed && fclose(file) == 0;
+        file = nullptr;
+        return ok;
+    }
+
+    // the record for the instruction that was at pc, after it was executed
+    void record(const Cpu &cpu, uint16_t pc, const DecodedOp &op) {
+        uint8_t bytes[13];
+        int n = 1;
+        uint8_t tag = 0;
+        if (pc != nextPc) {
+            tag |= 1;
+            put16(bytes, n, pc);
+        }
+        nextPc = pc + op.words;
+        uint64_t words = cpu.readROM(pc) | (uint64_t)cpu.readROM((uint16_t)(pc + 1)) << 16;
+        if (lastWords[pc] != words) {
+            lastWords[pc] = words;
+            tag |= 2;
+            put16(bytes, n, words);
+            put16(bytes, n, words >> 16);
+        }
+        int r = writtenRegister(op);
+        if (r > 0) {
+            uint16_t value = (r == 1) ? cpu.flags() : cpu.reg[r];
+            if (value != registers[r]) {
+                registers[r] = value;
+                tag |= 4 | r << 4;
+                put16(bytes, n, value);
+            }
+        }
+        if (op.opcode == 0x8) {
+            tag |= 8;
+            put16(bytes, n, op.address);
+            put16(bytes, n, (op.a == 1) ? cpu.flags() : cpu.reg[op.a]);
+        }
+        bytes[0] = tag;
+        put(bytes, n);
+    }
+
+    // the register (other than reg[0]) that op writes, or 0 if none
+    static int writtenRegister(const DecodedOp &op) {
+        switch (op.opcode) {
+          case 0x0:  return op.c;
+          case 0x3: case 0x4: case 0x5:  return 1;
+          case 0x6:  return op.b;
+          case 0x9: case 0xA:  return op.a;
+          default:   return 0;
+        }
+    }
+
+private:
+
+    static const size_t ringSize = 1 << 22;   // a power of 2
+
+    FILE *file = nullptr;
+    std::thread writer;
+    std::unique_ptr<uint8_t[]> ring;
+    bool failed = false;              // only the writer thread touches this until close()
+    std::atomic<bool> stopping{false};
+
+    // the program's side
+    uint64_t putIn = 0;
+    uint64_t takenOutSeen = 0;        // the last takenOut it read (it can only have grown since)
+    uint16_t nextPc = 0;
+    uint16_t registers[16];
+    std::vector<uint64_t> lastWords;  // the ROM words at each address the last time they ran (or ~0)
+
+    // the counters, each on its own cache line so the 2 threads don't slow each other down
+    alignas(64) std::atomic<uint64_t> published{0};
+    alignas(64) std::atomic<uint64_t> takenOut{0};
+
+    static void put16(uint8_t *bytes, int &n, uint16_t v) {
+        bytes[n++] = v & 0xFF;
+        bytes[n++] = v >> 8;
+    }
+
+    void put(const uint8_t *bytes, int n) {
+        if (putIn + n - takenOutSeen > ringSize)
+            while (putIn + n - (takenOutSeen = takenOut.load(std::memory_order_acquire)) > ringSize)
+                std::this_thread::yield();   // full, so wait for the writer
+        for (int i = 0; i < n; i++)
+            ring[(putIn + i) & (ringSize - 1)] = bytes[i];
+        putIn += n;
+        published.store(putIn, std::memory_order_release);
+    }
+
+    void writeLoop() {
+        uint64_t taken = 0;
+        for (;;) {
+            bool stop = stopping.load(std::memory_order_acquire);   // before reading published, so nothing is missed
+            uint64_t available = published.load(std::memory_order_acquire);
+            if (available == taken) {
+                if (stop)
+                    return;
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            size_t from = taken & (ringSize - 1);
+            size_t length = std::min<uint64_t>(available - taken, ringSize - from);
+            if (fwrite(ring.get() + from, 1, length, file) != length)
+                failed = true;
+            taken += length;
+            takenOut.store(taken, std::memory_order_release);
+        }
+    }
+
+};
+
+uint64_t Cpu::runTraced(uint64_t count) {
+    if (!decodedROMValid)
+        predecodeROM();
+    uint64_t i = 0;
+    for (; i < count && !halt; i++) {
+        uint16_t pc = reg[0];
+        const DecodedOp &op = decoded(pc);
+        execute(op);
+        if (atBreakpoint)
+            break;
+        trace->record(*this, pc, op);
+    }
+    settleFlags();
+    return i;
+}
+
+// prints a trace file as text, 1 line per instruction
+bool printTrace(const std::string &path, std::ostream &out, std::string &error) {
+
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        error = "can't open " + path;
+        return false;
+    }
+    std::unique_ptr<FILE, int (*)(FILE *)> closer(file, fclose);
+
+    uint8_t header[40];
+    if (fread(header, 1, 40, file) != 40 || std::memcmp(header, traceMagic, 4) != 0) {
+        error = path + " isn't a trace file";
+        return false;
+    }
+    uint16_t version = littleEndian16(header + 4);
+    if (version < 1 || version > traceVersion) {
+        error = path + " has an unknown trace version";
+        return false;
+    }
+    bool compact = false;
+    if (version >= 2) {
+        int low = getc(file), high = getc(file);
+        if (high == EOF) {
+            error = path + " is cut short";
+            return false;
+        }
+        compact = (low | high << 8) & imageCompact;
+    }
+    int registers = littleEndian16(header + 6);
+    if (registers > 16) {   // (the header only has room for 16, but any Cpu's trace will do)
+        error = path + " says it has " + std::to_string(registers) + " registers, more than a trace can hold";
+        return false;
+    }
+    uint16_t reg[16];
+    for (int r = 0; r < 16; r++)
+        reg[r] = littleEndian16(header + 8 + 2 * r);
+
+    std::vector<uint32_t> words(0x10000, 0xFFFFFFFF);
+    uint16_t pc = reg[0];
+    uint64_t count = 0;
+    bool cutShort = false;
+    auto get16 = [&]() -> uint16_t {
+        int low = getc(file), high = getc(file);
+        cutShort = cutShort || high == EOF;
+        return (uint16_t)(low | high << 8);
+    };
+
+    out << "registers:";
+    for (int r = 0; r < registers; r++)
+        out << ' ' << reg[r];
+    out << '\n';
+    for (int tag; (tag = getc(file)) != EOF; count++) {
+        if (tag & 1)
+            pc = get16();
+        if (tag & 2) {
+            uint16_t low = get16();
+            words[pc] = low | (uint32_t)get16() << 16;
+        }
+        char line[100];
+        uint8_t opcode = (words[pc] >> 12) & 0xF;
+        int n = (instructionWords(opcode, compact) == 2)
+            ? std::snprintf(line, sizeof(line), "%04x: %04x %04x  %s", pc, words[pc] & 0xFFFF, words[pc] >> 16, opcodeNames[opcode])
+            : std::snprintf(line, sizeof(line), "%04x: %04x       %s", pc, words[pc] & 0xFFFF, opcodeNames[opcode]);
+        if (tag & 4) {
+            int r = tag >> 4;
+            reg[r] = get16();
+            n += std::snprintf(line + n, sizeof(line) - n, "  reg[%d] = %u", r, reg[r]);
+        }
+        if (tag & 8) {
+            uint16_t address = get16();
+            uint16_t value = get16();
+            n += std::snprintf(line + n, sizeof(line) - n, "  RAM[%04x] = %u", address, value);
+        }
+        if (cutShort) {
+            error = path + " is cut short";
+            return false;
+        }
+        line[n++] = '\n';
+        out.write(line, n);
+        pc += instructionWords(opcode, compact);
+    }
+    out << count << " instructions" << std::endl;
+    return true;
+
+}
+
+
+
+
+
+/*
+    Time travel!  A TimeMachine runs a Cpu forward like runBatch() does, but every
+    checkpointInterval instructions, it saves a snapshot of the Cpu (a "checkpoint"),
+    which is cheap because a snapshot only copies the pages written since the last one.
+    Then it can go to any moment the program has already been through: seek() restores the
+    nearest checkpoint before that moment and runs forward from there, so even stepping back
+    1 instruction runs at most checkpointInterval instructions instead of the whole program.
+    reverseContinue() goes back to the last time the program reached a breakpoint.
+    Try it with...
+        ./cpu16 --step prog.s
+    and type a command at each prompt...
+        (just Enter) or s    --> run 1 instruction
+        c                    --> continue until a breakpoint (or HLT)
+        b ADDRESS            --> set a breakpoint at that ROM address (or remove it)
+        rs                   --> reverse step: go back 1 instruction
+        rc                   --> reverse continue: go back to the last breakpoint reached
+        g INSTRUCTION        --> go to the moment that many instructions into the run
+        q                    --> quit
+
+    Going back only works if running the past again does exactly what it did the first time.
+    Instructions do, but devices might not (like a timer), so the TimeMachine saves every value
+    a device gives to LD (in a DeviceReadLog) and gives the same values back in the past,
+    without asking the device. Arriving back at the furthest point the program has reached
+    restores the Cpu (and its devices) exactly as they were when it first went back.
+    OUT is quiet in the past (it already printed), and so is the Cpu's Tracer, if it has one,
+    so a trace is still just what happened once. Writes to devices do happen again, though,
+    so a UartDevice prints its text again.
+*/
+
+class TimeMachine {
+
+public:
+
+    explicit TimeMachine(Cpu &cpu, uint64_t checkpointInterval = 1000000)
+        : cpu(cpu), interval(checkpointInterval), realOutput(cpu.output), realTrace(cpu.trace) {
+        cpu.deviceReads = &deviceReads;
+        takeCheckpoint();
+    }
+
+    ~TimeMachine() {
+        cpu.deviceReads = nullptr;
+    }
+
+    uint64_t now() const {   // how many instructions into the run the Cpu is
+        return position;
+    }
+
+    uint64_t run(uint64_t count);
+    uint64_t runToBreakpoint(const std::vector<bool> &breakpoints, uint64_t count);
+    void seek(uint64_t instruction);
+    bool reverseStep();
+    bool reverseContinue(const std::vector<bool> &breakpoints);
+
+private:
+
+    struct Checkpoint {
+        Snapshot snapshot;
+        size_t deviceReads;   // how many values were in the DeviceReadLog then
+    };
+
+    Cpu &cpu;
+    uint64_t interval;
+    uint64_t position = 0;
+    uint64_t furthest = 0;    // the most instructions the program has run
+    std::vector< std::unique_ptr<Checkpoint> > checkpoints;   // checkpoints[k] is at k * interval
+    std::unique_ptr<Snapshot> present;   // the Cpu at furthest, once it has gone back from there
+    DeviceReadLog deviceReads;
+    OutputSink *realOutput;
+    Tracer *realTrace;
+    std::ostream nowhere{nullptr};
+    TextSink quiet{nowhere};
+
+    void takeCheckpoint() {
+        checkpoints.emplace_back(new Checkpoint);
+        cpu.takeSnapshot(checkpoints.back()->snapshot);
+        checkpoints.back()->deviceReads = deviceReads.values.size();
+    }
+
+};
+
+uint64_t TimeMachine::run(uint64_t count) {
+    uint64_t ran = 0;
+    while (ran < count && !cpu.halt) {
+        if (position == checkpoints.size() * interval)
+            takeCheckpoint();
+        uint64_t step = std::min(count - ran, interval - position % interval);
+        bool past = position < furthest;
+        if (past)
+            step = std::min(step, furthest - position);
+        cpu.output = past ? &quiet : realOutput;
+        cpu.trace = past ? nullptr : realTrace;
+        uint64_t n = cpu.runBatch(step);
+        position += n;
+        ran += n;
+        if (past && position == furthest && present) {
+            cpu.restoreSnapshot(*present);
+            deviceReads.next = deviceReads.values.size();
+        } else if (!past) {
+            furthest = position;
+            present.reset();
+        }
+    }
+    cpu.output = realOutput;
+    cpu.trace = realTrace;
+    return ran;
+}
+
+// runs until reg[0] is at a breakpoint (after at least 1 instruction), or HLT, or count instructions
+uint64_t TimeMachine::runToBreakpoint(const std::vector<bool> &breakpoints, uint64_t count) {
+    uint64_t ran = 0;
+    while (ran < count && !cpu.halt) {
+        ran += run(1);
+        if (breakpoints[cpu.reg[0]])
+            break;
+    }
+    return ran;
+}
+
+// going further than the program runs before it halts stops at the HLT
+void TimeMachine::seek(uint64_t instruction) {
+    if (instruction < position) {
+        if (position == furthest && !present) {
+            present.reset(new Snapshot);
+            cpu.takeSnapshot(*present);
+        }
+        size_t k = std::min<uint64_t>(instruction / interval, checkpoints.size() - 1);
+        cpu.restoreSnapshot(checkpoints[k]->snapshot);
+        deviceReads.next = checkpoints[k]->deviceReads;
+        position = k * interval;
+    }
+    run(instruction - position);
+}
+
+bool TimeMachine::reverseStep() {
+    if (position == 0)
+        return false;
+    seek(position - 1);
+    return true;
+}
+
+// false (and back to the start) if no breakpoint was reached before now
+bool TimeMachine::reverseContinue(const std::vector<bool> &breakpoints) {
+    uint64_t end = position;
+    for (uint64_t start = (end == 0) ? 0 : (end - 1) / interval * interval; end > 0; end = start, start -= interval) {
+        seek(start);
+        uint64_t last = end;
+        for (uint64_t t = start; t < end && !cpu.halt; t++) {
+            if (breakpoints[cpu.reg[0]])
+                last = t;
+            run(1);
+        }
+        if (last < end) {
+            seek(last);
+            return true;
+        }
+        if (start == 0)
+            break;
+    }
+    seek(0);
+    return false;
+}
+
+
+
+
+
+/*
+    Debug a running program with GDB (or anything else that speaks GDB's remote serial protocol)!
+        ./cpu16 --gdb 1234 prog.s
+    waits for a debugger to connect to TCP port 1234, with the program stopped at its first
+    instruction, then does what the debugger asks: read and write registers and memory,
+    set and remove breakpoints, step, continue, and stop (Ctrl-C) while running.
+    Breakpoints are patched into decodedROM[] (see Cpu::setBreakpoint()), so between them,
+    the program runs exactly as fast as without a debugger, with the JIT too.
+
+    GDB doesn't know this CPU, so the server describes it (with target.xml)...
+        registers   --> pc (32 bits, in bytes like the addresses below), then flags and
+                        the rest of the registers (16 bits each)
+        addresses   --> ROM word w is at bytes 2w and 2w + 1 (little-endian),
+                        and RAM word w is at 0x20000 + 2w (so x/4xh 0x20000 shows RAM[0] to RAM[3])
+    A program that halts looks like a process that exited.
+*/
+
+class GdbServer {
+
+public:
+
+    explicit GdbServer(Cpu &cpu) : cpu(cpu) {}
+
+    ~GdbServer() {
+        if (connection >= 0)
+            ::close(connection);
+        if (listener >= 0)
+            ::close(listener);
+    }
+
+    // waits for a debugger to connect
+    bool listen(uint16_t port, std::string &error) {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int yes = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || ::listen(listener, 1) != 0) {
+            error = "can't listen on port " + std::to_string(port);
+            return false;
+        }
+        std::cerr << "waiting for a debugger on port " << port << std::endl;
+        connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            error = "no debugger connected";
+            return false;
+        }
+        yes = 1;
+        setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        return true;
+    }
+
+    // answers the debugger until it detaches, kills the program, or disconnects
+    void serve() {
+        std::string packet;
+        bool done = false;
+        while (!done && receive(packet))
+            send(handle(packet, done));
+    }
+
+private:
+
+    Cpu &cpu;
+    int listener = -1, connection = -1;
+    std::string received;       // bytes from the debugger that haven't been handled yet
+    bool interrupted = false;   // the debugger sent Ctrl-C
+
+    static int hexDigit(char c) {
+        return std::isdigit((unsigned char)c) ? c - '0' : (std::tolower((unsigned char)c) - 'a' + 10) & 15;
+    }
+
+    static uint32_t hexNumber(const std::string &text, size_t &at) {
+        uint32_t value = 0;
+        for (; at < text.size() && std::isxdigit((unsigned char)text[at]); at++)
+            value = value << 4 | hexDigit(text[at]);
+        return value;
+    }
+
+    // little-endian hex, the way GDB wants register values and memory
+    static void putHex(std::string &out, uint32_t value, int bytes) {
+        static const char digits[] = "0123456789abcdef";
+        for (int i = 0; i < bytes; i++, value >>= 8) {
+            out += digits[(value >> 4) & 15];
+            out += digits[value & 15];
+        }
+    }
+
+    static uint32_t getHex(const std::string &text, size_t at, int bytes) {
+        uint32_t value = 0;
+        for (int i = 0; i < bytes && at + 2 * i + 1 < text.size(); i++)
+            value |= (uint32_t)(hexDigit(text[at + 2 * i]) << 4 | hexDigit(text[at + 2 * i + 1])) << (8 * i);
+        return value;
+    }
+
+    bool fill() {
+        char buffer[4096];
+        ssize_t n = recv(connection, buffer, sizeof(buffer), 0);
+        if (n <= 0)
+            return false;
+        received.append(buffer, n);
+        return true;
+    }
+
+    // the next packet's contents, acknowledging it (false when the debugger is gone)
+    // (one whose checksum is wrong gets a "-", so the debugger sends it again)
+    bool receive(std::string &packet) {
+        for (;;) {
+            size_t start = received.find('$');
+            if (received.find('\x03') < start)   // Ctrl-C while stopped: nothing to stop
+                received.erase(received.find('\x03'), 1);
+            size_t end = received.find('#', start);
+            if (start != std::string::npos && end != std::string::npos && end + 2 < received.size()) {
+                packet = received.substr(start + 1, end - start - 1);
+                uint8_t sum = 0;
+                for (char c : packet)
+                    sum += c;
+                bool good = std::isxdigit((unsigned char)received[end + 1]) && std::isxdigit((unsigned char)received[end + 2])
+                            && getHex(received, end + 1, 1) == sum;
+                received.erase(0, end + 3);
+                if (::send(connection, good ? "+" : "-", 1, 0) != 1)
+                    return false;
+                if (good)
+                    return true;
+            }
+            if (!fill())
+                return false;
+        }
+    }
+
+    void send(const std::string &data) {
+        uint8_t sum = 0;
+        for (char c : data)
+            sum += c;
+        std::string packet = "$" + data + "#";
+        putHex(packet, sum, 1);
+        ::send(connection, packet.data(), packet.size(), 0);
+    }
+
+    // is there a Ctrl-C from the debugger? (doesn't wait)
+    bool checkInterrupt() {
+        pollfd p = { connection, POLLIN, 0 };
+        while (!interrupted && poll(&p, 1, 0) > 0 && fill()) {
+            size_t at = received.find('\x03');
+            if (at != std::string::npos) {
+                received.erase(at, 1);
+                interrupted = true;
+            }
+        }
+        return interrupted;
+    }
+
+    // 2 bytes per ROM or RAM word, see above
+    uint8_t readByte(uint32_t address) {
+        uint16_t word = (address < 0x20000) ? cpu.readROM(address >> 1) : cpu.RAM.read((address >> 1) & 0xFFFF);
+        return (address & 1) ? word >> 8 : word & 0xFF;
+    }
+
+    void writeByte(uint32_t address, uint8_t value) {
+        uint16_t word = (address < 0x20000) ? cpu.readROM(address >> 1) : cpu.RAM.read((address >> 1) & 0xFFFF);
+        word = (address & 1) ? (word & 0x00FF) | value << 8 : (word & 0xFF00) | value;
+        if (address < 0x20000) {
+            cpu.writeROM(address >> 1, word);
+        } else {
+            cpu.RAM[(address >> 1) & 0xFFFF] = word;
+            cpu.markRAMDirty((address >> 1) & 0xFFFF, 1);
+        }
+    }
+
+    std::string stopReply() {
+        if (cpu.halt && !cpu.atBreakpoint)
+            return "W00";
+        return interrupted ? "S02" : "S05";
+    }
+
+    // runs the instruction at reg[0] (even if there's a breakpoint on it), then maybe carries on
+    std::string resume(bool step) {
+        interrupted = false;
+        cpu.halt = cpu.atBreakpoint = false;
+        cpu.runInstruction(cpu.readROM(cpu.reg[0]), cpu.readROM((uint16_t)(cpu.reg[0] + 1)));
+        while (!step && !cpu.halt && !checkInterrupt())
+            cpu.runBatch(1 << 16);
+        cpu.output->flush();
+        return stopReply();
+    }
+
+    std::string targetXML() const {
+        std::string xml = "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\"><target version=\"1.0\">"
+                          "<feature name=\"org.cpu16.core\"><reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+                          "<reg name=\"flags\" bitsize=\"16\"/>";
+        for (int r = 2; r < cpuRegisters; r++)
+            xml += "<reg name=\"r" + std::to_string(r) + "\" bitsize=\"16\"/>";
+        return xml + "</feature></target>";
+    }
+
+    std::string handle(const std::string &packet, bool &done) {
+        std::string reply;
+        size_t at = 1;
+        switch (packet.empty() ? 0 : packet[0]) {
+
+          case '?':
+            return stopReply();
+
+          case 'g':
+            putHex(reply, 2 * cpu.reg[0], 4);
+            for (int r = 1; r < cpuRegisters; r++)
+                putHex(reply, cpu.reg[r], 2);
+            return reply;
+
+          case 'G':   // pc (8 hex digits), then the rest of the registers (4 each)
+            if (packet.size() < 1 + 8 + 4 * (size_t)(cpuRegisters - 1))
+                return "E01";
+            cpu.reg[0] = getHex(packet, 1, 4) >> 1;
+            for (int r = 1; r < cpuRegisters; r++)
+                cpu.reg[r] = getHex(packet, 9 + 4 * (r - 1), 2);
+            return "OK";
+
+          case 'p': {
+            uint32_t r = hexNumber(packet, at);
+            if (r >= (uint32_t)cpuRegisters)
+                return "E01";
+            putHex(reply, r ? cpu.reg[r] : 2 * cpu.reg[0], r ? 2 : 4);
+            return reply;
+          }
+
+          case 'P': {
+            uint32_t r = hexNumber(packet, at);
+            if (r >= (uint32_t)cpuRegisters || at >= packet.size() || packet[at] != '=')
+                return "E01";
+            cpu.reg[r] = r ? getHex(packet, at + 1, 2) : getHex(packet, at + 1, 4) >> 1;
+            return "OK";
+          }
+
+          case 'm': {
+            uint32_t address = hexNumber(packet, at);
+            at++;
+            uint32_t length = std::min<uint32_t>(hexNumber(packet, at), 0x1000);
+            for (uint32_t i = 0; i < length && address + i < 0x40000; i++)
+                putHex(reply, readByte(address + i), 1);
+            return reply.empty() ? "E01" : reply;
+          }
+
+          case 'M': {
+            uint32_t address = hexNumber(packet, at);
+            at++;
+            uint32_t length = hexNumber(packet, at);
+            at++;
+            if (at > packet.size() || (packet.size() - at) / 2 < length)
+                return "E01";
+            for (uint32_t i = 0; i < length && address + i < 0x40000; i++)
+                writeByte(address + i, getHex(packet, at + 2 * i, 1));
+            return "OK";
+          }
+
+          case 's':
+          case 'c':
+            if (packet.size() > 1)   // from a new address
+                cpu.reg[0] = hexNumber(packet, at) >> 1;
+            return resume(packet[0] == 's');
+
+          case 'Z':
+          case 'z': {   // only software breakpoints (Z0), at ROM addresses
+            if (packet.size() < 3 || packet[1] != '0' || packet[2] != ',')
+                return "";
+            at = 3;
+            uint32_t address = hexNumber(packet, at);
+            if (address >= 0x20000)
+                return "E01";
+            cpu.setBreakpoint(address >> 1, packet[0] == 'Z');
+            return "OK";
+          }
+
+          case 'k':
+          case 'D':
+            done = true;
+            return "OK";
+
+          case 'H':
+            return "OK";
+
+          case 'q':
+            if (packet.compare(0, 10, "qSupported") == 0)
+                return "PacketSize=4000;qXfer:features:read+";
+            if (packet == "qAttached")
+                return "1";
+            if (packet == "qC")
+                return "QC1";
+            if (packet == "qfThreadInfo")
+                return "m1";
+            if (packet == "qsThreadInfo")
+                return "l";
+            if (packet.compare(0, 31, "qXfer:features:read:target.xml:") == 0) {
+                at = 31;
+                uint32_t offset = hexNumber(packet, at);
+                at++;
+                uint32_t length = hexNumber(packet, at);
+                std::string xml = targetXML();
+                if (offset >= xml.size())
+                    return "l";
+                std::string part = xml.substr(offset, length);
+                return (offset + part.size() < xml.size() ? "m" : "l") + part;
+            }
+            return "";
+
+          default:
+            return "";   // not supported
+        }
+    }
+
+};
+
+
+
+
+
+/*
+    For long-running programs, there's an even faster option: a JIT (just-in-time compiler)!
+    Instead of interpreting instructions, runJit() translates them into real x86-64 machine code
+    that your computer runs directly. Run it via...
+        ./cpu16 --jit
+
+    The JIT translates a "basic block" at a time: a run of instructions starting at some
+    program counter and ending at the first J or HLT (J and HLT are the only instructions
+    that can send the program counter anywhere but the next instruction).
+    While translated code runs, registers 1 to 4 live in the host CPU's registers...
+        reg[1] --> rbx      reg[2] --> rbp      reg[3] --> r12      reg[4] --> r13
+    and any others (see cpuRegisters) stay in reg[], going through r8 or r9 when used.
+    r14 holds the address of reg[], and r15 counts down the instructions left to run.
+    MOV and LD load their page's entry in RAM.pages[] (see PagedRAM) through r14 too, since
+    translated code can run on any Cpu sharing the Jit, so every page the Jit's code uses
+    gets touched (Jit::ramPages[]) before any of its code runs.
+    Each block adds all of its cycles to Cpu::cycles as it starts, like runThreaded() does.
+    The program counter isn't needed while inside a block (each instruction's address is known
+    when translating), so it's only written to reg[0] when leaving the JIT.
+
+    Each way out of a block starts as a jump to a little "stub" that returns to runJit().
+    Once the block at that destination gets translated, the jump is patched to point right at it,
+    so hot loops run from block to block without ever returning to runJit().
+
+    A block stops early at any instruction that the JIT doesn't know how to translate
+    (for example, ones using reg[0]), and runJit() hands that instruction to the interpreter.
+    The interpreter is always the reference: the JIT must do exactly what it does!
+    The JIT only exists on x86-64 Linux and other Unix-like systems, and elsewhere
+    (or when compiled with -DCPU16_NO_JIT) runJit() just calls the interpreter.
+    That includes AArch64 (ARM), which has no JIT yet: it would need its own versions
+    of the emit functions below, and registers to keep reg[1] to reg[4] in.
+
+    The code memory is never writable and executable at the same time ("W^X"), so a bug
+    that writes through a stray pointer can't change code that's about to run: it's
+    writable while the JIT translates, patches jumps or flushes, and mprotect() makes it
+    executable instead just before translated code runs (see Jit::run()).
+*/
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(CPU16_NO_JIT)
+#define CPU16_JIT
+#endif
+
+#ifdef CPU16_JIT
+
+enum JitExit { JIT_EXIT_MISS, JIT_EXIT_BUDGET, JIT_EXIT_HALT, JIT_EXIT_STOP };
+
+// x86-64 register numbers
+enum HostReg { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+               R8 = 8, R9 = 9, R12 = 12, R13 = 13, R14 = 14, R15 = 15 };
+
+const int jitHostReg[5] = { -1, RBX, RBP, R12, R13 };   // -1 means "not translated"
+const size_t jitCodeSize = 1 << 22;
+const int jitMaxBlockLength = 256;
+const size_t jitBlockBytes = 31 + 21 + 16;   // the most translate() emits for a block besides its instructions (see Jit::maxCodeBytes())
+
+typedef uint32_t (*JitEntry)(uint16_t *registers, const uint8_t *code, int64_t *budget, Cpu *cpu);
+
+// a Jit (and its code memory) belongs to one Cpu, or to every Cpu with the same SharedROM
+// that one BatchRunner worker runs (so only one thread ever uses it)
+class Jit {
+
+public:
+
+    uint8_t *code = nullptr;         // the code memory
+    size_t used = 0;
+    bool writable = true;            // whether code is writable right now (otherwise it's executable)
+    bool broken = false;             // the operating system won't give us executable memory
+    uint32_t romVersion = 0;         // the decodedROMVersion that was translated
+    bool devices[256];               // which pages of RAM were devices' when translating
+    bool ramPages[256];              // which pages of RAM translated code reads or writes
+    JitEntry enter = nullptr;
+    uint8_t *leave = nullptr;
+    uint8_t *blocks[0x10000];        // translated code for each program counter
+    bool untranslatable[0x10000];    // the block starting here has nothing the JIT can translate
+    std::unordered_map< uint16_t, std::vector<uint8_t *> > pendingChains;   // jumps to patch once their destination exists
+
+    Jit() {
+        std::fill(devices, devices + 256, false);
+        flush();
+    }
+
+    // whether cpu's devices are on the pages code was translated for (if it's shared, cpu might not be the one it was for)
+    bool sameDevices(const Cpu &cpu) const {
+        for (int p = 0; p < 256; p++)
+            if (devices[p] != (cpu.devicePages[p].device != nullptr))
+                return false;
+        return true;
+    }
+
+    ~Jit() {
+        if (code)
+            munmap(code, jitCodeSize);
+    }
+
+    // returns whether to stop (see Cpu::stopOnOutput)
+    static uint32_t output(Cpu *cpu, uint32_t value) {
+        cpu->output->write(value);
+        if (!cpu->stopOnOutput)
+            return 0;
+        cpu->halt = cpu->pausedOnOutput = true;
+        return 1;
+    }
+
+    // ahead is the cycles of this instruction and the rest of its block, which were already added,
+    // so the device sees when the instruction starts (like with the interpreter)
+    static uint32_t deviceRead(Cpu *cpu, uint32_t address, uint32_t ahead) {
+        cpu->cycles -= ahead;
+        uint32_t value = cpu->readRAM(address);
+        cpu->cycles += ahead;
+        return value;
+    }
+
+    static void deviceWrite(Cpu *cpu, uint32_t address, uint32_t value, uint32_t ahead) {
+        cpu->cycles -= ahead;
+        cpu->writeRAM(address, value);
+        cpu->cycles += ahead;
+    }
+
+    // The little assembler used to write the machine code
+
+    void emit8(uint8_t b) {
+        code[used++] = b;
+    }
+
+    void emit32(uint32_t v) {
+        std::memcpy(code + used, &v, 4);
+        used += 4;
+    }
+
+    void emit64(uint64_t v) {
+        std::memcpy(code + used, &v, 8);
+        used += 8;
+    }
+
+    void emitRex(int reg, int rm, bool wide) {
+        uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+        if (rex != 0x40)
+            emit8(rex);
+    }
+
+    // opcode with a register-to-register ModRM byte (32-bit operands)
+    void emitRR(uint8_t opcode, int rm, int reg) {
+        emitRex(reg, rm, false);
+        emit8(opcode);
+        emit8(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // opcode with one register and a 3-bit opcode extension in ModRM, then a 32-bit immediate
+    void emitRImm32(uint8_t opcode, int extension, int rm, uint32_t imm) {
+        emitRex(0, rm, false);
+        emit8(opcode);
+        emit8(0xC0 | (extension << 3) | (rm & 7));
+        emit32(imm);
+    }
+
+    void emitMovImm32(int r, uint32_t imm) {
+        emitRex(0, r, false);
+        emit8(0xB8 | (r & 7));
+        emit32(imm);
+    }
+
+    // movzx r32, word [r14 + disp]
+    void emitLoadReg(int r, uint8_t disp) {
+        emitRex(r, R14, false);
+        emit8(0x0F);
+        emit8(0xB7);
+        emit8(0x40 | ((r & 7) << 3) | (R14 & 7));
+        emit8(disp);
+    }
+
+    // mov word [r14 + disp], r16
+    void emitStoreReg(int r, uint8_t disp) {
+        emit8(0x66);
+        emitRex(r, R14, false);
+        emit8(0x89);
+        emit8(0x40 | ((r & 7) << 3) | (R14 & 7));
+        emit8(disp);
+    }
+
+    // mov rax, qword [r14 + disp32] (RAM.pages[] is at a fixed distance from reg[] inside the Cpu)
+    void emitLoadPage(int32_t disp) {
+        emit8(0x49);
+        emit8(0x8B);
+        emit8(0x80 | (RAX << 3) | (R14 & 7));
+        emit32((uint32_t)disp);
+    }
+
+    // movzx r32, word [rax + disp32]
+    void emitLoadMem(int r, int32_t disp) {
+        emitRex(r, RAX, false);
+        emit8(0x0F);
+        emit8(0xB7);
+        emit8(0x80 | ((r & 7) << 3) | RAX);
+        emit32((uint32_t)disp);
+    }
+
+    // mov word [rax + disp32], r16
+    void emitStoreMem(int r, int32_t disp) {
+        emit8(0x66);
+        emitRex(r, RAX, false);
+        emit8(0x89);
+        emit8(0x80 | ((r & 7) << 3) | RAX);
+        emit32((uint32_t)disp);
+    }
+
+    // jmp or jcc with a 32-bit displacement, returning where the displacement lives so it can be patched
+    uint8_t *emitJump(uint8_t condition, const uint8_t *target) {
+        if (condition) {
+            emit8(0x0F);
+            emit8(condition);
+        } else {
+            emit8(0xE9);
+        }
+        uint8_t *displacement = code + used;
+        emit32((uint32_t)(target - (displacement + 4)));
+        return displacement;
+    }
+
+    void patchJump(uint8_t *displacement, const uint8_t *target) {
+        uint32_t v = (uint32_t)(target - (displacement + 4));
+        std::memcpy(displacement, &v, 4);
+    }
+
+    // leave the JIT with reg[0] = pc
+    void emitExitStub(uint16_t pc, JitExit why) {
+        emit8(0x66);            // mov word [r14], pc
+        emit8(0x41);
+        emit8(0xC7);
+        emit8(0x06);
+        emit8(pc & 0xFF);
+        emit8(pc >> 8);
+        emitMovImm32(RAX, why);
+        emitJump(0, leave);
+    }
+
+    // a patchable jump to the block at pc (or to a stub that returns to runJit() if it isn't translated yet)
+    void emitChainExit(uint16_t pc) {
+        if (blocks[pc]) {
+            emitJump(0, blocks[pc]);
+            return;
+        }
+        uint8_t *displacement = emitJump(0, code + used + 5);
+        pendingChains[pc].push_back(displacement);
+        emitExitStub(pc, JIT_EXIT_MISS);
+    }
+
+    // the code that enters and leaves translated code, following the System V calling convention
+    void emitTrampolines() {
+
+        enter = (JitEntry)(code + used);
+        emit8(0x53);                          // push rbx
+        emit8(0x55);                          // push rbp
+        emit8(0x41); emit8(0x54);             // push r12
+        emit8(0x41); emit8(0x55);             // push r13
+        emit8(0x41); emit8(0x56);             // push r14
+        emit8(0x41); emit8(0x57);             // push r15
+        emit8(0x52);                          // push rdx
+        emit8(0x51);                          // push rcx
+        emit8(0x48); emit8(0x83); emit8(0xEC); emit8(0x08);    // sub rsp, 8 (keeps the stack 16-byte aligned for calls)
+        emit8(0x49); emit8(0x89); emit8(0xFE);    // mov r14, rdi
+        emit8(0x4C); emit8(0x8B); emit8(0x3A);    // mov r15, [rdx]
+        for (int i = 1; i <= 4; i++)
+            emitLoadReg(jitHostReg[i], 2*i);
+        emit8(0xFF); emit8(0xE6);             // jmp rsi
+
+        leave = code + used;          // eax holds a JitExit
+        for (int i = 1; i <= 4; i++)
+            emitStoreReg(jitHostReg[i], 2*i);
+        emit8(0x48); emit8(0x83); emit8(0xC4); emit8(0x08);    // add rsp, 8
+        emit8(0x59);                          // pop rcx
+        emit8(0x5A);                          // pop rdx
+        emit8(0x4C); emit8(0x89); emit8(0x3A);    // mov [rdx], r15
+        emit8(0x41); emit8(0x5F);             // pop r15
+        emit8(0x41); emit8(0x5E);             // pop r14
+        emit8(0x41); emit8(0x5D);             // pop r13
+        emit8(0x41); emit8(0x5C);             // pop r12
+        emit8(0x5D);                          // pop rbp
+        emit8(0x5B);                          // pop rbx
+        emit8(0xC3);                          // ret
+
+    }
+
+    // makes the code memory writable (and not executable), or executable (and not writable)
+    bool protect(bool write) {
+        if (write == writable)
+            return true;
+        if (mprotect(code, jitCodeSize, write ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0) {
+            broken = true;
+            return false;
+        }
+        writable = write;
+        return true;
+    }
+
+    // runs translated code, making it executable first if the JIT just wrote some
+    uint32_t run(uint16_t *registers, const uint8_t *at, int64_t *budget, Cpu *cpu) {
+        if (!protect(false))
+            return JIT_EXIT_BUDGET;   // (runs the rest in the interpreter, and the JIT won't be used again)
+        return enter(registers, at, budget, cpu);
+    }
+
+    // forget all translated code (after ROM changes, or when the code memory fills up)
+    void flush() {
+        std::memset(blocks, 0, sizeof(blocks));
+        std::memset(untranslatable, 0, sizeof(untranslatable));
+        std::memset(ramPages, 0, sizeof(ramPages));
+        pendingChains.clear();
+        used = 0;
+        if (code && protect(true))
+            emitTrampolines();
+    }
+
+    bool init() {
+        if (broken)
+            return false;
+        if (code)
+            return true;
+        void *memory = mmap(nullptr, jitCodeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            broken = true;
+            return false;
+        }
+        code = (uint8_t *)memory;
+        writable = true;
+        flush();
+        return !broken;
+    }
+
+    void usePage(Cpu &cpu, uint8_t p) {
+        cpu.RAM.touch(p);
+        ramPages[p] = true;
+    }
+
+    // touches the pages of cpu's RAM that translated code uses, before running any of it
+    void touchPages(Cpu &cpu) const {
+        for (int p = 0; p < 256; p++)
+            if (ramPages[p] && !cpu.RAM.touched(p))
+                cpu.RAM.touch(p);
+    }
+
+    static bool registerOK(uint8_t r) {
+        return r >= 5 || jitHostReg[r] >= 0;
+    }
+
+    // the host register holding guest register r, first loading it into scratch if it stays in reg[]
+    int source(int r, int scratch) {
+        if (r < 5)
+            return jitHostReg[r];
+        emitLoadReg(scratch, 2 * r);
+        return scratch;
+    }
+
+    // where to put a value for guest register r, and then store() it there
+    static int target(int r, int scratch) {
+        return (r < 5) ? jitHostReg[r] : scratch;
+    }
+
+    void store(int r, int host) {
+        if (r >= 5)
+            emitStoreReg(host, 2 * r);
+    }
+
+    // the most bytes translate() can emit for op, counting the longest form of each helper
+    // (like a register kept in reg[], which is 5 bytes to load and 5 to store);
+    // OUT is the most since it calls output() and might leave through an exit stub,
+    // and a block adds jitBlockBytes (the budget check, falling off its end, and the budget exit stub)
+    static size_t maxCodeBytes(const DecodedOp &op) {
+        switch (op.opcode) {
+          case 0x0:  return 24;             // ADD
+          case 0x3: case 0x4:  return 37;   // AND, OR
+          case 0x5:  return 45;             // CMP
+          case 0x6:  return 10;             // CPY
+          case 0x7:  return 67;             // OUT
+          case 0x8:  return 35;             // MOV (to a device, 28 otherwise)
+          case 0x9:  return 32;             // LD (from a device, 20 otherwise)
+          case 0xA:  return 11;             // LDV
+          case 0xE:  return 54;             // J (a conditional one, with 2 chain exits)
+          default:   return 16;             // HLT (an exit stub)
+        }
+    }
+
+    static bool canTranslate(const DecodedOp &op) {
+        switch (op.opcode) {
+          case 0x0:  return registerOK(op.a) && registerOK(op.b) && registerOK(op.c);
+          case 0x3:  return registerOK(op.a) && registerOK(op.b);
+          case 0x4:  return registerOK(op.a) && registerOK(op.b);
+          case 0x5:  return registerOK(op.a) && registerOK(op.b);
+          case 0x6:  return registerOK(op.a) && registerOK(op.b);
+          case 0x7:  return registerOK(op.a);
+          case 0x8:  return registerOK(op.a);
+          case 0x9:  return registerOK(op.a);
+          case 0xA:  return registerOK(op.a);
+          case breakpointOpcode:  return false;   // the interpreter stops there
+          case undecodedOpcode:   return false;   // runJit() decodes it first, when it's reached
+          default:   return true;   // J, and HLT (which is every undefined instruction)
+        }
+    }
+
+    // translates the block starting at pc, returning null if its first instruction can't be translated
+    // (touching cpu's pages of RAM that it uses)
+    uint8_t *translate(Cpu &cpu, uint16_t pc) {
+
+        if (!protect(true))
+            return nullptr;
+        int length = 0;
+        uint32_t cycles = 0;
+        size_t bytes = jitBlockBytes;   // at most
+        uint16_t end = pc;
+        bool endsBlock = false;
+        while (length < jitMaxBlockLength && !endsBlock && canTranslate(cpu.decodedROM[end])) {
+            uint8_t opcode = cpu.decodedROM[end].opcode;
+            endsBlock = !(opcode == 0x0 || opcode == 0x3 || opcode == 0x4 || opcode == 0x5 || opcode == 0x6 || opcode == 0x7 || opcode == 0x8 || opcode == 0x9 || opcode == 0xA);
+            cycles += cycleCosts[opcode];
+            bytes += maxCodeBytes(cpu.decodedROM[end]);
+            length++;
+            end += cpu.decodedROM[end].words;
+        }
+        if (length == 0) {
+            untranslatable[pc] = true;
+            return nullptr;
+        }
+
+        if (used + bytes > jitCodeSize)
+            flush();
+
+        const int rbx = jitHostReg[1];
+        const int32_t pagesOffset = (int32_t)((const char *)cpu.RAM.pages - (const char *)cpu.reg);
+        const int32_t dirtyOffset = (int32_t)((const char *)cpu.ramDirty - (const char *)cpu.reg);
+        const int32_t cyclesOffset = (int32_t)((const char *)&cpu.cycles - (const char *)cpu.reg);
+        uint8_t *entry = code + used;
+        blocks[pc] = entry;
+
+        // is there enough budget left for the whole block?
+        emit8(0x49); emit8(0x81); emit8(0xFF); emit32(length);    // cmp r15, length
+        uint8_t *budgetJump = emitJump(0x8C, entry);              // jl (patched below)
+        emit8(0x49); emit8(0x81); emit8(0xEF); emit32(length);    // sub r15, length
+        emit8(0x49); emit8(0x81); emit8(0x86);                    // add qword [r14 + cyclesOffset], cycles
+        emit32(cyclesOffset);
+        emit32(cycles);
+
+        uint16_t p = pc;
+        for (int i = 0; i < length; i++, p += cpu.decodedROM[p].words) {
+
+            const DecodedOp &op = cpu.decodedROM[p];
+            uint32_t ahead = cycles;   // of this instruction and the rest of the block
+            cycles -= cycleCosts[op.opcode];
+            switch (op.opcode) {
+
+              /* ADD */
+              case 0x0: {
+                int a = source(op.a, R8), b = source(op.b, R9);
+                emitRR(0x89, RAX, a);                                  // mov eax, A
+                emitRR(0x01, RAX, b);                                  // add eax, B
+                emit8(0x0F); emit8(0xB7); emit8(0xC0);                 // movzx eax, ax
+                if (op.c < 5)
+                    emitRR(0x89, jitHostReg[op.c], RAX);               // mov C, eax
+                store(op.c, RAX);
+                break;
+              }
+
+              /* AND, OR (translated code keeps reg[1] up to date, so there are no lazy flags here) */
+              case 0x3:
+              case 0x4: {
+                int a = source(op.a, R8), b = source(op.b, R9);
+                emitRImm32(0x81, 4, rbx, 0xFFF8);                      // and flags, ~7 (before reading A and B)
+                emitRR(0x89, RAX, a);                                  // mov eax, A
+                emitRR(op.opcode == 0x3 ? 0x21 : 0x09, RAX, b);        // and/or eax, B
+                emitMovImm32(RCX, 1);                                  // ecx = 1 (greater than 0)
+                emitMovImm32(RDX, 2);                                  // edx = 2 (equal to 0)
+                emit8(0x0F); emit8(0x44); emit8(0xCA);                 // cmovz ecx, edx
+                emitRR(0x09, rbx, RCX);                                // or flags, ecx
+                break;
+              }
+
+              /* CMP */
+              case 0x5: {
+                int a = source(op.a, R8), b = source(op.b, R9);
+                emitRR(0x31, RAX, RAX);                                // xor eax, eax
+                emitRR(0x31, RCX, RCX);
+                emitRR(0x31, RDX, RDX);
+                emitRImm32(0x81, 4, rbx, 0xFFF8);                      // and flags, ~7 (before comparing, like execute())
+                emitRR(0x39, a, b);                                    // cmp A, B
+                emit8(0x0F); emit8(0x97); emit8(0xC0);                 // seta al
+                emit8(0x0F); emit8(0x94); emit8(0xC1);                 // sete cl
+                emit8(0x0F); emit8(0x92); emit8(0xC2);                 // setb dl
+                emit8(0xD1); emit8(0xE1);                              // shl ecx, 1
+                emit8(0xC1); emit8(0xE2); emit8(0x02);                 // shl edx, 2
+                emitRR(0x09, RAX, RCX);                                // or eax, ecx
+                emitRR(0x09, RAX, RDX);                                // or eax, edx
+                emitRR(0x09, rbx, RAX);                                // or flags, eax
+                break;
+              }
+
+              /* CPY */
+              case 0x6: {
+                int a = source(op.a, R8);
+                if (op.b < 5)
+                    emitRR(0x89, jitHostReg[op.b], a);
+                store(op.b, a);
+                break;
+              }
+
+              /* OUT */
+              case 0x7: {
+                int a = source(op.a, R8);
+                emit8(0x48); emit8(0x8B); emit8(0x7C); emit8(0x24); emit8(0x08);   // mov rdi, [rsp+8] (the Cpu)
+                emitRR(0x89, RSI, a);                                  // mov esi, A
+                emit8(0x48); emit8(0xB8); emit64((uint64_t)&output);   // mov rax, output
+                emit8(0xFF); emit8(0xD0);                              // call rax
+                emitRR(0x85, RAX, RAX);                                // test eax, eax
+                uint8_t *keepGoing = emitJump(0x84, entry);            // jz (patched below)
+                emit8(0x49); emit8(0x81); emit8(0xC7); emit32(length - i - 1);   // add r15, what won't run
+                emit8(0x49); emit8(0x81); emit8(0xAE);                 // sub qword [r14 + cyclesOffset], its cycles
+                emit32(cyclesOffset);
+                emit32(cycles);
+                emitExitStub(p + op.words, JIT_EXIT_STOP);
+                patchJump(keepGoing, code + used);
+                break;
+              }
+
+              /* MOV */
+              case 0x8: {
+                int a = source(op.a, R8);
+                if (cpu.devicePages[op.address >> 8].device) {
+                    emit8(0x48); emit8(0x8B); emit8(0x7C); emit8(0x24); emit8(0x08);   // mov rdi, [rsp+8] (the Cpu)
+                    emitMovImm32(RSI, op.address);                     // mov esi, address
+                    emitRR(0x89, RDX, a);                              // mov edx, A
+                    emitMovImm32(RCX, ahead);                          // mov ecx, ahead
+                    emit8(0x48); emit8(0xB8); emit64((uint64_t)&deviceWrite);   // mov rax, deviceWrite
+                    emit8(0xFF); emit8(0xD0);                          // call rax
+                } else {
+                    usePage(cpu, op.address >> 8);
+                    emitLoadPage(pagesOffset + 8 * (op.address >> 8));
+                    emitStoreMem(a, 2 * (op.address & 0xFF));
+                    emit8(0x41); emit8(0xC6); emit8(0x86);             // mov byte [r14 + disp32], 1
+                    emit32((uint32_t)(dirtyOffset + (op.address >> 8)));
+                    emit8(1);
+                }
+                break;
+              }
+
+              /* LD */
+              case 0x9:
+                if (cpu.devicePages[op.address >> 8].device) {
+                    emit8(0x48); emit8(0x8B); emit8(0x7C); emit8(0x24); emit8(0x08);   // mov rdi, [rsp+8] (the Cpu)
+                    emitMovImm32(RSI, op.address);                     // mov esi, address
+                    emitMovImm32(RDX, ahead);                          // mov edx, ahead
+                    emit8(0x48); emit8(0xB8); emit64((uint64_t)&deviceRead);    // mov rax, deviceRead
+                    emit8(0xFF); emit8(0xD0);                          // call rax
+                    if (op.a < 5)
+                        emitRR(0x89, jitHostReg[op.a], RAX);           // mov A, eax
+                    store(op.a, RAX);
+                } else {
+                    usePage(cpu, op.address >> 8);
+                    emitLoadPage(pagesOffset + 8 * (op.address >> 8));
+                    emitLoadMem(target(op.a, R8), 2 * (op.address & 0xFF));
+                    store(op.a, R8);
+                }
+                break;
+
+              /* LDV */
+              case 0xA:
+                emitMovImm32(target(op.a, R8), op.address);
+                store(op.a, R8);
+                break;
+
+              /* J */
+              case 0xE:
+                if (op.a > 1) {
+                    emitChainExit(op.address);
+                } else {
+                    emitRImm32(0xF7, 0, rbx, 1u << op.b);                // test flags, bit
+                    uint8_t *taken = emitJump(op.a ? 0x85 : 0x84, entry); // jnz or jz (patched below)
+                    emitChainExit(p + op.words);
+                    patchJump(taken, code + used);
+                    emitChainExit(op.address);
+                }
+                break;
+
+              /* undefined instructions are HLT */
+              default:
+                emitExitStub(p + op.words, JIT_EXIT_HALT);
+                break;
+
+            }
+
+        }
+        if (!endsBlock)
+            emitChainExit(p);
+
+        patchJump(budgetJump, code + used);
+        emitExitStub(pc, JIT_EXIT_BUDGET);
+
+        // now that this block exists, other blocks can jump right to it
+        std::unordered_map< uint16_t, std::vector<uint8_t *> >::iterator pending = pendingChains.find(pc);
+        if (pending != pendingChains.end()) {
+            for (uint8_t *displacement : pending->second)
+                patchJump(displacement, entry);
+            pendingChains.erase(pending);
+        }
+
+        return entry;
+
+    }
+
+};
+
+#else
+
+class Jit {};
+
+#endif
+
+// defined here since it needs to know what a Jit is to delete one
+Cpu::~Cpu() {
+    if (romMapping)
+        munmap(romMapping, romMappingBytes);
+}
+
+// makes the JIT (the first time), and throws away any code it made for an older ROM or device map
+bool Cpu::prepareJit() {
+#ifdef CPU16_JIT
+    if (!jit)
+        jit = std::make_shared<Jit>();
+    if (!jit->init())
+        return false;
+    if (!decodedROMValid)
+        predecodeROM();
+    if (jit->romVersion != decodedROMVersion || !jit->sameDevices(*this)) {
+        jit->flush();
+        jit->romVersion = decodedROMVersion;
+        for (int p = 0; p < 256; p++)
+            jit->devices[p] = (devicePages[p].device != nullptr);
+    }
+    jit->touchPages(*this);
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t Cpu::runJit(uint64_t count) {
+#ifdef CPU16_JIT
+    if (!prepareJit())
+        return runInterpreter(count);
+
+    int64_t remaining = count;
+    while (remaining > 0 && !halt) {
+        uint8_t *code = jit->blocks[reg[0]];
+        if (!code && !jit->untranslatable[reg[0]]) {
+            decoded(reg[0]);
+            code = jit->translate(*this, reg[0]);
+        }
+        if (!code) {
+            remaining -= runInterpreter(1);
+            continue;
+        }
+        uint32_t why = jit->run(reg, code, &remaining, this);
+        if (why == JIT_EXIT_HALT) {
+            halt = true;
+            output->flush();
+        }
+        else if (why == JIT_EXIT_BUDGET)
+            remaining -= runInterpreter(remaining);
+    }
+    return count - remaining;
+#else
+    return runInterpreter(count);
+#endif
+}
+
+/*
+    Translating a program costs far more than running most of it once, and a lot of a program
+    (like fib's LDVs before its loop) only ever runs once. Tiered running...
+        ./cpu16 --turbo --tiered
+    starts every instruction in the interpreter, without superinstructions, and counts how often
+    each backward J is taken. When one has been taken...
+        fuseThreshold times --> its loop (from where it lands to the J) gets superinstructions
+        jitThreshold times  --> the JIT translates the loop, and runs it from then on
+    so only hot loops pay for fusing or translating. Only threaded dispatch has the handlers
+    that count and promote loops, so builds with -DCPU16_DISPATCH_SWITCH turn --tiered away,
+    and without CPU16_JIT nothing goes past superinstructions.
+    Cpus sharing a SharedROM (like BatchRunner's) promote loops in a TieredROM, for all of them.
+    Try lowering jitThreshold to 2, and see how much slower fib gets!
+*/
+
+const char *tieredNeedsThreaded = "tiered running needs threaded dispatch, and this was compiled with -DCPU16_DISPATCH_SWITCH";
+
+// moves the loop from head to the backward J at jump up a tier, depending on how often it's gone around
+void Cpu::promote(uint16_t head, uint16_t jump) {
+    Tier tier = TIER_FUSED;
+#ifdef CPU16_JIT
+    if (backEdges[head] >= jitThreshold)
+        tier = TIER_JIT;
+#endif
+    uint32_t step = compact ? 1 : 2;
+    auto needed = [&](const std::vector<uint8_t> &now) {
+        for (uint32_t p = head; p <= jump; p += step)
+            if (now[p] < tier)
+                return true;
+        return tier == TIER_JIT && now[head] != TIER_JIT_ENTRY;
+    };
+    changeTiers(needed, [&] {
+        for (uint32_t p = head; p <= jump; p += step)
+            tiers[p] = std::max(tiers[p], (uint8_t)tier);
+        if (tier == TIER_JIT)
+            tiers[head] = TIER_JIT_ENTRY;
+        for (uint32_t p = head; p <= jump; p += step)
+            fuse(p);
+    });
+}
+
+// makes a change to tiers[] and decodedROM[] (unless it isn't needed any more). With a TieredROM,
+// it goes into a copy of the current SharedROM instead (which this Cpu switches to in catchUpTiers()),
+// so it's safe even in the middle of runThreaded(), which keeps running the one it started with
+void Cpu::changeTiers(const std::function<bool(const std::vector<uint8_t> &tiers)> &needed, const std::function<void()> &change) {
+    if (!tieredROM) {
+        if (needed(tiers))
+            change();
+        return;
+    }
+    std::lock_guard<std::mutex> guard(tieredROM->lock);
+    if (!needed(tieredROM->current->tiers))
+        return;   // another Cpu got there first
+    std::shared_ptr<SharedROM> copy(new SharedROM(*tieredROM->current));
+    DecodedOp *wasDecoded = decodedROM;
+    uint8_t *wasLength = blockLength;
+    uint16_t *wasCycles = blockCycles;
+    decodedROM = copy->decodedROM;
+    blockLength = copy->blockLength;
+    blockCycles = copy->blockCycles;
+    std::swap(tiers, copy->tiers);
+    change();
+    std::swap(tiers, copy->tiers);
+    decodedROM = wasDecoded;
+    blockLength = wasLength;
+    blockCycles = wasCycles;
+    copy->version = newROMVersion();
+    tieredROM->current = copy;
+}
+
+// switches to the TieredROM's current SharedROM, if it has promotions this Cpu's doesn't
+// (only call it between runs, since runThreaded() keeps pointers into the old one)
+void Cpu::catchUpTiers() {
+    if (!tieredROM)
+        return;
+    std::shared_ptr<const SharedROM> rom;
+    {
+        std::lock_guard<std::mutex> guard(tieredROM->lock);
+        rom = tieredROM->current;
+    }
+    if (rom == sharedROM && !tiers.empty())
+        return;
+    sharedROM = rom;
+    pointAtROM();
+    tiers = rom->tiers;
+    if (backEdges.empty())
+        backEdges.assign(0x10000, 0);
+    decodedROMValid = true;
+    decodedROMVersion = rom->version;
+}
+
+uint64_t Cpu::runTiered(uint64_t count) {
+#ifndef CPU16_THREADED
+    return runInterpreter(count);   // (only threaded dispatch has the handlers that count and promote loops)
+#endif
+    if (tieredROM)
+        catchUpTiers();
+    else if (tiers.empty() && decodedROMValid)
+        invalidateDecodedROM();   // it was predecoded before tiered was set
+#ifdef CPU16_JIT
+    if (!prepareJit())
+        return runInterpreter(count);
+
+    int64_t remaining = count;
+    while (remaining > 0 && !halt) {
+        uint16_t pc = reg[0];
+        if (tiers[pc] < TIER_JIT) {
+            remaining -= runInterpreter(remaining);   // until it gets to a loop the JIT has
+            continue;
+        }
+        uint8_t *code = jit->blocks[pc];
+        if (!code && !jit->untranslatable[pc]) {
+            decoded(pc);
+            code = jit->translate(*this, pc);
+        }
+        if (!code) {
+            if (tiers[pc] == TIER_JIT_ENTRY) {   // leave this loop fused, instead
+                changeTiers([&](const std::vector<uint8_t> &now) { return now[pc] == TIER_JIT_ENTRY; }, [&] {
+                    tiers[pc] = TIER_FUSED;
+                    fuse(pc);
+                });
+                if (tieredROM) {
+                    catchUpTiers();   // (or the SharedROM it's running would keep handing pc back)
+                    prepareJit();
+                }
+            }
+            remaining -= runSwitch(1);
+            continue;
+        }
+        uint32_t why = jit->run(reg, code, &remaining, this);
+        if (why == JIT_EXIT_HALT) {
+            halt = true;
+            output->flush();
+        }
+        else if (why == JIT_EXIT_BUDGET)
+            remaining -= runSwitch(remaining);
+    }
+    return count - remaining;
+#else
+    return runInterpreter(count);
+#endif
+}
+
+uint64_t Cpu::runBatch(uint64_t count) {
+    if (trace)
+        return runTraced(count);
+#ifndef CPU16_NO_PROFILE
+    if (profile)
+        return runProfiled(count);
+#endif
+    if (tiered)
+        return runTiered(count);
+    return useJit ? runJit(count) : runInterpreter(count);
+}
+
+RunStatus Cpu::run(uint64_t maxInstructions) {
+    return runUntil(StopWhen(), maxInstructions);
+}
+
+/*
+    Stopping at a pc borrows a breakpoint, and stopping on output makes OUT set halt, so neither
+    costs anything until it happens. The budget is in instructions (which the interpreter and
+    the JIT only check as each basic block starts), so a cycle is closed in on by running as
+    many instructions as can't go past it, over and over; it's reached as soon as Cpu::cycles
+    gets to it or past it (by less than maxCycleCost).
+    (With the JIT, a borrowed breakpoint does make it translate the program again.)
+*/
+RunStatus Cpu::runUntil(const StopWhen &when, uint64_t maxInstructions) {
+
+    if (halt && !atBreakpoint)
+        return RUN_HALTED;
+    if (cycles >= when.cycle)
+        return RUN_REACHED_CYCLE;
+    uint64_t budget = maxInstructions;
+
+    // carry on from a breakpoint (or from when.pc, where the last call may have stopped)
+    // by running the instruction that's really there first, so calling again always gets somewhere
+    stopOnOutput = when.output;
+    if ((atBreakpoint || reg[0] == when.pc) && budget > 0) {
+        halt = atBreakpoint = false;
+        if (isBreakpoint(reg[0]))
+            runInstruction(readROM(reg[0]), readROM((uint16_t)(reg[0] + 1)));   // (which a breakpoint is in the way of)
+        else
+            runBatch(1);   // (which still traces and profiles it)
+        budget--;
+    }
+
+    bool borrowed = when.pc >= 0 && !isBreakpoint(when.pc);
+    if (borrowed)
+        setBreakpoint(when.pc, true);
+    while (budget > 0 && cycles < when.cycle && !halt)
+        budget -= runBatch(std::min(budget, std::max<uint64_t>(1, (when.cycle - cycles) / maxCycleCost)));
+    stopOnOutput = false;
+    if (borrowed)
+        setBreakpoint(when.pc, false);
+
+    if (pausedOnOutput) {
+        halt = pausedOnOutput = false;
+        return RUN_OUTPUT;
+    }
+    if (atBreakpoint && reg[0] == when.pc) {
+        if (borrowed)
+            halt = atBreakpoint = false;
+        return RUN_REACHED_PC;
+    }
+    if (atBreakpoint)
+        return RUN_BREAKPOINT;
+    if (halt)
+        return RUN_HALTED;
+    if (reg[0] == when.pc)
+        return RUN_REACHED_PC;   // the budget ran out just as it got there
+    return cycles >= when.cycle ? RUN_REACHED_CYCLE : RUN_BUDGET;
+
+}
+
+/*
+    Running lots of short programs?  A BatchRunner runs a list of jobs on all of your
+    computer's cores at once, instead of you starting this code over and over. Try...
+        ./cpu16 --batch 10000 --threads 8
+
+    Each job is a program image plus an "input": words copied into RAM starting at
+    RAM[0x0000] after the image loads (a program reads them with LD).
+    Many jobs can share a single image, so running one program on lots of inputs is cheap.
+
+    Each worker thread takes turns running the Cpus it owns for a time slice of instructions,
+    so one long program can't hog a worker. A worker out of work first starts a new job,
+    and if there are none left, it "steals" a Cpu from the back of another worker's queue.
+    Each worker only keeps a few Cpus going at once, so memory use stays small however many
+    jobs there are. Jobs with the same image all share one SharedROM (and with tiered running,
+    one TieredROM), and with the JIT, each worker has one Jit for each SharedROM,
+    shared by all of its Cpus using it.
+    A job stops when it halts, or when it has run maxInstructions instructions
+    (in case it never halts).
+    Everything a job prints with OUT is saved in its JobResult instead of going to std::cout,
+    so the outputs of different jobs never get mixed up.
+*/
+
+struct Job {
+    std::shared_ptr<const Image> image;
+    std::shared_ptr<const Snapshot> snapshot;   // restored after the image loads, if set
+    std::vector<uint16_t> input;   // copied into RAM starting at RAM[0x0000]
+    uint64_t imageHash = 0;        // if set, contentHash() of the image's file (see ROMCache)
+};
+
+/*
+    Decoding a ROM into a SharedROM takes a while, so a ROMCache keeps the one for each image
+    (and with tiered running, its TieredROM) for as long as the ROMCache is around.
+    BatchRunner::run() makes one for each run unless it's given one to keep using, like
+    a FleetWorker's, which lasts as long as the connection to its coordinator.
+    An image is known by its Job::imageHash when it has one (every job a FleetWorker runs does),
+    and otherwise by where the Image is in memory (which is only the same image during one run).
+
+    The first thread to ask for an image decodes it without holding the ROMCache's lock
+    (so threads after other images don't wait for it), and threads asking for the same
+    image meanwhile wait on its std::shared_future.
+*/
+class ROMCache {
+
+public:
+
+    // image's SharedROM, made the first time it's asked for (null if it can't be),
+    // and with tiered running, the TieredROM that Cpus running it promote loops in
+    std::shared_ptr<const SharedROM> get(const Job &job, uint32_t fusions, bool tiered, std::shared_ptr<TieredROM> &tiering) {
+        std::shared_future<Decoded> decoded;
+        std::promise<Decoded> decoding;
+        bool decoder = false;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            Entry &entry = entries[job.imageHash ? job.imageHash : (uint64_t)(uintptr_t)job.image.get()];
+            if (!entry.decoded.valid() || entry.fusions != fusions || entry.tiered != tiered) {
+                entry.decoded = decoding.get_future().share();
+                entry.fusions = fusions;
+                entry.tiered = tiered;
+                decoder = true;
+            }
+            decoded = entry.decoded;
+        }
+        if (decoder) {
+            Decoded made;
+            std::string error;
+            made.rom = SharedROM::make(*job.image, fusions, error, tiered);
+            if (made.rom && tiered) {
+                made.tiering = std::make_shared<TieredROM>();
+                made.tiering->current = made.rom;
+            }
+            decoding.set_value(made);
+        }
+        tiering = decoded.get().tiering;
+        return decoded.get().rom;
+    }
+
+private:
+
+    struct Decoded {
+        std::shared_ptr<const SharedROM> rom;   // null if the image can't be decoded
+        std::shared_ptr<TieredROM> tiering;     // only with tiered running
+    };
+
+    struct Entry {
+        std::shared_future<Decoded> decoded;
+        uint32_t fusions = 0;
+        bool tiered = false;
+    };
+
+    std::mutex lock;
+    std::unordered_map<uint64_t, Entry> entries;
+
+};
+
+struct JobResult {
+    bool halted = false;          // false means it ran out of instructions first
+    uint64_t instructions = 0;
+    uint16_t reg[16] = {0};
+    std::string output;
+    std::string error;            // why the image didn't load
+};
+
+class BatchRunner {
+
+public:
+
+    unsigned threads = std::thread::hardware_concurrency();   // 0 if unknown, which runs 1
+    uint64_t sliceInstructions = 1 << 16;
+    uint64_t maxInstructions = UINT64_MAX;
+    unsigned activePerWorker = 4;
+    bool useJit = false;
+    bool tiered = false;
+    uint32_t fusions = fuseAll;
+    uint64_t ramSeed = 0;         // every job's RAM starts out the same (see PagedRAM)
+    Profile *profile = nullptr;   // if set, every job is profiled and the counts are added up here
+    std::function<void(size_t job, const JobResult &result)> finished;   // if set, called (on a worker thread) as each job finishes
+    std::shared_ptr<ROMCache> roms;   // if set, keeps decoded ROMs between runs (otherwise each run makes its own)
+
+    std::vector<JobResult> run(const std::vector<Job> &jobs);
+
+private:
+
+    struct Task {
+        size_t job;
+        std::unique_ptr<Cpu> cpu;
+        std::ostringstream text;
+        std::unique_ptr<TextSink> output;
+        std::unique_ptr<Profile> profile;
+        uint64_t instructions = 0;
+        std::string error;
+    };
+
+    struct Worker {
+        std::mutex lock;
+        std::deque< std::unique_ptr<Task> > queue;
+        unsigned active = 0;   // Tasks this worker owns, whether queued or running
+        std::unordered_map< uint32_t, std::shared_ptr<Jit> > jits;   // for each SharedROM's version
+    };
+
+    const std::vector<Job> *jobs = nullptr;
+    std::shared_ptr<ROMCache> romsInUse;
+    std::vector<JobResult> *results = nullptr;
+    std::vector< std::unique_ptr<Worker> > workers;
+    std::atomic<size_t> nextJob{0};
+    std::atomic<size_t> unfinished{0};
+    std::mutex profileLock;
+    std::mutex idleLock;               // for idle and requeued, and unfinished reaching 0
+    std::condition_variable idle;      // workers with nothing to run wait here
+    uint64_t requeued = 0;             // how many times a Task has gone back on a queue (so could be stolen)
+
+    std::unique_ptr<Task> startJob();
+    std::unique_ptr<Task> steal(size_t thief);
+    void work(size_t w);
+
+};
+
+// a Task for the next job not started yet (null once they all have),
+// called without the worker's lock since loading the image can take a while
+std::unique_ptr<BatchRunner::Task> BatchRunner::startJob() {
+    size_t j = nextJob.fetch_add(1);
+    if (j >= jobs->size())
+        return nullptr;
+
+    std::unique_ptr<Task> task(new Task);
+    task->job = j;
+    task->cpu.reset(new Cpu);
+    task->cpu->RAM.reset(ramSeed);
+    const Job &job = (*jobs)[j];
+    std::shared_ptr<TieredROM> tiering;
+    if (job.image && !task->cpu->loadImage(*job.image, task->error, romsInUse->get(job, fusions, tiered, tiering)))
+        task->cpu->halt = true;
+    task->cpu->tieredROM = tiering;
+    if (job.snapshot)
+        task->cpu->restoreSnapshot(*job.snapshot);
+    for (size_t i = 0; i < job.input.size() && i < 0x10000; i++)
+        task->cpu->RAM[i] = job.input[i];
+    task->cpu->markRAMDirty(0, job.input.size());
+    task->output.reset(new TextSink(task->text));
+    task->cpu->output = task->output.get();
+    task->cpu->useJit = useJit;
+    task->cpu->tiered = tiered;
+    task->cpu->setFusions(fusions);
+    if (profile) {
+        task->profile.reset(new Profile);
+        task->cpu->profile = task->profile.get();
+    }
+    return task;
+}
+
+std::unique_ptr<BatchRunner::Task> BatchRunner::steal(size_t thief) {
+    for (size_t i = 1; i < workers.size(); i++) {
+        Worker &victim = *workers[(thief + i) % workers.size()];
+        std::unique_ptr<Task> task;
+        {
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (victim.queue.empty())
+                continue;
+            task = std::move(victim.queue.back());
+            victim.queue.pop_back();
+            victim.active--;
+        }
+        std::lock_guard<std::mutex> guard(workers[thief]->lock);
+        workers[thief]->active++;
+        return task;
+    }
+    return nullptr;
+}
+
+void BatchRunner::work(size_t w) {
+
+    Worker &me = *workers[w];
+
+    while (unfinished.load() > 0) {
+
+        uint64_t seen;
+        {
+            std::lock_guard<std::mutex> guard(idleLock);
+            seen = requeued;
+        }
+
+        std::unique_ptr<Task> task;
+        bool starting = false;
+        {
+            std::lock_guard<std::mutex> guard(me.lock);
+            if (!me.queue.empty()) {
+                task = std::move(me.queue.front());
+                me.queue.pop_front();
+            } else if (me.active < activePerWorker) {
+                me.active++;   // (now, so a thief can't take us over activePerWorker meanwhile)
+                starting = true;
+            }
+        }
+        if (starting && !(task = startJob())) {
+            std::lock_guard<std::mutex> guard(me.lock);
+            me.active--;
+        }
+        if (!task)
+            task = steal(w);
+        if (!task) {
+            // every job has started and there's nothing to steal, so wait until a Task
+            // goes back on a queue (if none has since we looked) or the last job finishes
+            std::unique_lock<std::mutex> guard(idleLock);
+            idle.wait(guard, [&] { return requeued != seen || unfinished.load() == 0; });
+            continue;
+        }
+
+        Cpu &cpu = *task->cpu;
+        cpu.catchUpTiers();   // (first, since it can change decodedROMVersion)
+        if ((cpu.useJit || cpu.tiered) && cpu.sharedROM) {   // (stolen Cpus too, since a Jit can only run on one thread)
+            std::shared_ptr<Jit> &jit = me.jits[cpu.decodedROMVersion];
+            if (!jit)
+                jit = std::make_shared<Jit>();
+            cpu.jit = jit;
+        }
+        uint64_t slice = std::min(sliceInstructions, maxInstructions - task->instructions);
+        task->instructions += cpu.runBatch(slice);
+
+        if (task->cpu->halt || task->instructions >= maxInstructions) {
+            JobResult &result = (*results)[task->job];
+            result.halted = task->cpu->halt;
+            result.instructions = task->instructions;
+            std::copy(task->cpu->reg, task->cpu->reg + 16, result.reg);
+            task->output->flush();
+            result.output = task->text.str();
+            result.error = task->error;
+            if (finished)
+                finished(task->job, result);
+            if (profile) {
+                std::lock_guard<std::mutex> guard(profileLock);
+                profile->add(*task->profile);
+            }
+            task.reset();
+            {
+                std::lock_guard<std::mutex> guard(me.lock);
+                me.active--;
+            }
+            std::lock_guard<std::mutex> guard(idleLock);
+            if (--unfinished == 0)
+                idle.notify_all();
+        } else {
+            {
+                std::lock_guard<std::mutex> guard(me.lock);
+                me.queue.push_back(std::move(task));
+            }
+            {
+                std::lock_guard<std::mutex> guard(idleLock);
+                requeued++;
+            }
+            idle.notify_one();
+        }
+
+    }
+
+}
+
+std::vector<JobResult> BatchRunner::run(const std::vector<Job> &jobList) {
+
+    std::vector<JobResult> resultList(jobList.size());
+    jobs = &jobList;
+    results = &resultList;
+    romsInUse = roms ? roms : std::make_shared<ROMCache>();
+    nextJob = 0;
+    unfinished = jobList.size();
+    requeued = 0;
+
+    size_t count = std::max(1u, threads);
+    workers.clear();
+    for (size_t w = 0; w < count; w++)
+        workers.emplace_back(new Worker);
+
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < count; w++)
+        pool.emplace_back(&BatchRunner::work, this, w);
+    work(0);
+    for (std::thread &t : pool)
+        t.join();
+
+    workers.clear();
+    romsInUse.reset();
+    return resultList;
+
+}
+
+
+
+
+
+/*
+    Running one program on lots of different inputs (like a fuzzer does)? A LaneCpu<LANES>
+    runs LANES copies of a program at once, in "lockstep"...
+        ./cpu16 --batch 10000 --lanes 16 prog.img
+
+    Each copy is a "lane", and lane l's register k is reg[k][l] (and its RAM[a] is RAM[a][l]),
+    so each instruction is a loop over LANES values sitting side by side in memory.
+    Those loops have no branches in them (lanes that shouldn't run an instruction are
+    "masked off" by blend()), so the compiler turns them into SIMD instructions
+    (SSE2 or NEON, or AVX2 and AVX-512 with -march=native) that do 8 to 32 lanes at a time.
+
+    While every lane is at the same program counter, they all run each instruction.
+    Once a J goes one way for some lanes and the other way for others, the lanes with the
+    lowest program counter run next while the rest wait, which soon brings them back together.
+    But a lane stuck in a loop below the others would keep them waiting forever,
+    so once a lane has waited laneMaxWait steps, the lane that has waited longest goes next.
+    Lane results are the same as running each copy on its own Cpu.
+    Lanes have 16 registers like a Cpu, and no devices (MOV and LD are RAM only).
+
+    There are no intrinsics (like _mm256_add_epi16() for AVX2) on purpose: plain loops over
+    LANES let the compiler pick the widest SIMD your computer has, for any LANES, and
+    keep this code running anywhere C++ does. (Add -fopt-info-vec to see what got vectorized.)
+*/
+
+const uint16_t laneMaxWait = 256;
+
+inline uint16_t blend(uint16_t mask, uint16_t yes, uint16_t no) {
+    return (yes & mask) | (no & ~mask);
+}
+
+template <int LANES>
+class LaneCpu {
+
+public:
+
+    uint16_t reg[16][LANES];
+    std::vector< std::array<uint16_t, LANES> > RAM = std::vector< std::array<uint16_t, LANES> >(0x10000);
+    bool halt[LANES];
+    uint64_t instructions[LANES];    // how many each lane has run
+    uint64_t maxInstructions = UINT64_MAX;   // a lane stops once it has run this many
+    uint64_t ramSeed = 0;                    // for each lane's RAM, as if it was a Cpu's (see PagedRAM)
+    OutputSink *output[LANES];
+    uint16_t waited[LANES];          // how many steps each lane has been kept waiting (see laneMaxWait)
+
+    LaneCpu() : base(new Cpu) {}
+
+    bool load(const Image *image, const Snapshot *snapshot, std::string &error);
+    void loadInput(int lane, const std::vector<uint16_t> &input);
+    uint64_t run(uint64_t steps);
+
+private:
+
+    std::unique_ptr<Cpu> base;   // holds ROM and decodedROM (shared by every lane)
+
+};
+
+// every lane starts out the same: the image loaded, then the snapshot restored
+template <int LANES>
+bool LaneCpu<LANES>::load(const Image *image, const Snapshot *snapshot, std::string &error) {
+    base.reset(new Cpu);
+    base->RAM.reset(ramSeed);
+    if (image && !base->loadImage(*image, error))
+        return false;
+    if (snapshot)
+        base->restoreSnapshot(*snapshot);
+    base->predecodeROM();
+    for (int k = 0; k < 16; k++)
+        for (int l = 0; l < LANES; l++)
+            reg[k][l] = base->reg[k];
+    for (uint32_t a = 0; a < 0x10000; a++)
+        RAM[a].fill(base->RAM.read(a));
+    for (int l = 0; l < LANES; l++) {
+        halt[l] = base->halt;
+        instructions[l] = 0;
+        waited[l] = 0;
+        output[l] = &base->standardOutput;
+    }
+    return true;
+}
+
+template <int LANES>
+void LaneCpu<LANES>::loadInput(int lane, const std::vector<uint16_t> &input) {
+    for (size_t i = 0; i < input.size() && i < 0x10000; i++)
+        RAM[i][lane] = input[i];
+}
+
+// runs up to steps instructions (each on every lane at its program counter), returning how many it ran
+// (0 once every lane has halted or run maxInstructions)
+template <int LANES>
+uint64_t LaneCpu<LANES>::run(uint64_t steps) {
+
+    // 0xFFFF for lanes still going, and no lane can run out of instructions partway through
+    uint16_t going[LANES];
+    bool any = false;
+    for (int l = 0; l < LANES; l++) {
+        going[l] = (!halt[l] && instructions[l] < maxInstructions) ? 0xFFFF : 0;
+        if (going[l]) {
+            steps = std::min(steps, maxInstructions - instructions[l]);
+            any = true;
+        }
+    }
+    if (!any)
+        return 0;
+    steps = std::min<uint64_t>(steps, 0xFFFF);   // so ran[] can't overflow
+
+    uint16_t ran[LANES] = {0};
+    uint16_t m[LANES];   // 0xFFFF for the lanes running this instruction, otherwise 0
+    uint16_t t[LANES];   // results, before they're blended into the lanes that ran
+    uint16_t pc = 0;
+    bool together = false;   // every lane still going is at pc (so m[] is going[])
+    uint64_t step = 0;
+    for (; step < steps; step++) {
+
+        // the lowest program counter of any lane still going goes next,
+        // unless a lane has waited too long (then the one that has waited longest does)
+        if (!together) {
+            pc = 0xFFFF;
+            uint16_t longest = 0;
+            for (int l = 0; l < LANES; l++) {
+                pc = std::min<uint16_t>(pc, reg[0][l] | ~going[l]);
+                longest = std::max<uint16_t>(longest, waited[l] & going[l]);
+            }
+            if (pc == 0xFFFF && !std::any_of(going, going + LANES, [](uint16_t g) { return g; }))
+                break;
+            if (longest >= laneMaxWait)
+                for (int l = 0; l < LANES; l++)
+                    if ((waited[l] & going[l]) == longest) {
+                        pc = reg[0][l];
+                        break;
+                    }
+            uint16_t apart = 0;
+            for (int l = 0; l < LANES; l++) {
+                m[l] = going[l] & -(uint16_t)(reg[0][l] == pc);
+                apart |= m[l] ^ going[l];
+                waited[l] = (waited[l] + 1) & ~m[l];   // (while they're together, every lane still going runs)
+            }
+            together = !apart;
+        }
+
+        const DecodedOp op = base->decoded(pc);
+        for (int l = 0; l < LANES; l++) {
+            reg[0][l] = blend(m[l], pc + op.words, reg[0][l]);
+            ran[l] += m[l] & 1;
+        }
+
+        // while the lanes are together, pc just follows them (unless an instruction changes reg[0])
+        uint16_t *a = reg[op.a], *b = reg[op.b], *c = reg[op.c], *flags = reg[1];
+        bool pcWritten = (op.opcode == 0x0 && op.c == 0) || (op.opcode == 0x6 && op.b == 0)
+                           || ((op.opcode == 0x9 || op.opcode == 0xA) && op.a == 0);
+        together = together && !pcWritten;
+        pc += op.words;
+        switch (op.opcode) {
+
+          /* ADD */
+          case 0x0:
+            for (int l = 0; l < LANES; l++)
+                t[l] = a[l] + b[l];
+            for (int l = 0; l < LANES; l++)
+                c[l] = blend(m[l], t[l], c[l]);
+            break;
+
+          /* AND, OR (flags are cleared first, like execute()) */
+          case 0x3:
+          case 0x4:
+            for (int l = 0; l < LANES; l++)
+                flags[l] &= ~(m[l] & 7);
+            for (int l = 0; l < LANES; l++)
+                t[l] = op.opcode == 0x3 ? a[l] & b[l] : a[l] | b[l];
+            for (int l = 0; l < LANES; l++)
+                t[l] = t[l] ? 1 : 2;
+            for (int l = 0; l < LANES; l++)
+                flags[l] |= t[l] & m[l];
+            break;
+
+          /* CMP (flags are cleared first, like execute()) */
+          case 0x5:
+            for (int l = 0; l < LANES; l++)
+                flags[l] &= ~(m[l] & 7);
+            for (int l = 0; l < LANES; l++)
+                t[l] = (a[l] > b[l]) | (a[l] == b[l]) << 1 | (a[l] < b[l]) << 2;
+            for (int l = 0; l < LANES; l++)
+                flags[l] |= t[l] & m[l];
+            break;
+
+          /* CPY */
+          case 0x6:
+            for (int l = 0; l < LANES; l++)
+                t[l] = a[l];
+            for (int l = 0; l < LANES; l++)
+                b[l] = blend(m[l], t[l], b[l]);
+            break;
+
+          /* OUT */
+          case 0x7:
+            for (int l = 0; l < LANES; l++)
+                if (m[l])
+                    output[l]->write(a[l]);
+            break;
+
+          /* MOV */
+          case 0x8: {
+            uint16_t *ram = RAM[op.address].data();
+            for (int l = 0; l < LANES; l++)
+                t[l] = a[l];
+            for (int l = 0; l < LANES; l++)
+                ram[l] = blend(m[l], t[l], ram[l]);
+            break;
+          }
+
+          /* LD */
+          case 0x9: {
+            const uint16_t *ram = RAM[op.address].data();
+            for (int l = 0; l < LANES; l++)
+                t[l] = ram[l];
+            for (int l = 0; l < LANES; l++)
+                a[l] = blend(m[l], t[l], a[l]);
+            break;
+          }
+
+          /* LDV */
+          case 0xA:
+            for (int l = 0; l < LANES; l++)
+                a[l] = blend(m[l], op.address, a[l]);
+            break;
+
+          /* J */
+          case 0xE:
+            for (int l = 0; l < LANES; l++)
+                t[l] = (op.a > 1) ? 0xFFFF : -(uint16_t)(((flags[l] >> op.b) & 1) == op.a);
+            for (int l = 0; l < LANES; l++)
+                reg[0][l] = blend(m[l] & t[l], op.address, reg[0][l]);
+            if (together) {
+                uint16_t some = 0, all = 0xFFFF;
+                for (int l = 0; l < LANES; l++) {
+                    some |= m[l] & t[l];
+                    all &= ~m[l] | t[l];
+                }
+                if (all)
+                    pc = op.address;
+                else if (some)
+                    together = false;   // the lanes went different ways
+            }
+            break;
+
+          /* undefined instructions are HLT */
+          default:
+            for (int l = 0; l < LANES; l++)
+                if (m[l]) {
+                    halt[l] = true;
+                    going[l] = 0;
+                    output[l]->flush();
+                }
+            together = false;
+            break;
+
+        }
+
+    }
+
+    for (int l = 0; l < LANES; l++)
+        instructions[l] += ran[l];
+    return step;
+
+}
+
+// runs jobs LANES at a time (consecutive jobs with the same image and snapshot share a LaneCpu)
+template <int LANES>
+std::vector<JobResult> runLanes(const std::vector<Job> &jobs, uint64_t maxInstructions, uint64_t ramSeed) {
+
+    std::vector<JobResult> results(jobs.size());
+    std::unique_ptr< LaneCpu<LANES> > cpu(new LaneCpu<LANES>);
+    cpu->ramSeed = ramSeed;
+
+    for (size_t first = 0; first < jobs.size(); ) {
+
+        size_t count = 1;
+        while (count < LANES && first + count < jobs.size()
+                 && jobs[first + count].image == jobs[first].image && jobs[first + count].snapshot == jobs[first].snapshot)
+            count++;
+
+        std::string error;
+        if (!cpu->load(jobs[first].image.get(), jobs[first].snapshot.get(), error)) {
+            for (size_t j = first; j < first + count; j++)
+                results[j].error = error;
+            first += count;
+            continue;
+        }
+
+        std::ostringstream text[LANES];
+        std::unique_ptr<TextSink> sinks[LANES];
+        for (int l = 0; l < LANES; l++) {
+            sinks[l].reset(new TextSink(text[l]));
+            cpu->output[l] = sinks[l].get();
+            if ((size_t)l < count)
+                cpu->loadInput(l, jobs[first + l].input);
+            else
+                cpu->halt[l] = true;   // no job for this lane
+        }
+
+        cpu->maxInstructions = maxInstructions;
+        while (cpu->run(1 << 16) > 0)
+            ;
+
+        for (size_t l = 0; l < count; l++) {
+            JobResult &result = results[first + l];
+            result.halted = cpu->halt[l];
+            result.instructions = cpu->instructions[l];
+            for (int k = 0; k < 16; k++)
+                result.reg[k] = cpu->reg[k][l];
+            sinks[l]->flush();
+            result.output = text[l].str();
+        }
+        first += count;
+
+    }
+    return results;
+
+}
+
+// runLanes() for a number of lanes chosen when running (8, 16 or 32)
+bool runLanes(unsigned lanes, const std::vector<Job> &jobs, uint64_t maxInstructions, uint64_t ramSeed, std::vector<JobResult> &results) {
+    switch (lanes) {
+      case 8:   results = runLanes<8>(jobs, maxInstructions, ramSeed);   return true;
+      case 16:  results = runLanes<16>(jobs, maxInstructions, ramSeed);  return true;
+      case 32:  results = runLanes<32>(jobs, maxInstructions, ramSeed);  return true;
+      default:  return false;
+    }
+}
+
+
+
+
+
+/*
+    Regression sweeps bigger than one computer? Start a worker on each computer ("node")...
+        ./cpu16 --worker 5000
+    then run the batch from anywhere, listing the nodes...
+        ./cpu16 --batch 100000 --nodes box1:5000,box2:5000 prog.img
+    The coordinator (the second command) hands each node a chunk of jobs at a time
+    (fleetChunkJobs, or fewer if there aren't many, so every node gets some).
+    A node runs them with a BatchRunner on all of its cores (or with --lanes, if given),
+    and sends back each job's JobResult (what it printed with OUT, its registers, how many
+    instructions it ran...) as soon as that job finishes. A node gets another chunk once
+    its last one is done, so faster nodes run more of them, and if a node goes away,
+    its unfinished jobs go to the others. The output is the same as with one computer.
+    (Jobs can't start from a snapshot yet, so --restore doesn't work with --nodes.)
+
+    Nodes keep each image (by a hash of its image file's bytes, see contentHash()) for as
+    long as they run, so an image is only sent to a node once, however many jobs or sweeps
+    use it, and each image's decoded ROM (see ROMCache) for as long as the coordinator is connected. A worker runs whatever it's sent, so only start one on a network you trust!
+
+    Everything goes over TCP in frames (all numbers are little-endian)...
+        bytes 0-3     how many bytes follow
+        bytes 4-5     type (see FleetFrame)
+        bytes 6-...   the payload
+    The coordinator sends FLEET_SETTINGS and FLEET_HAVE, then FLEET_IMAGE for each hash
+    in the node's FLEET_NEED, then the FLEET_JOBs of a chunk and a FLEET_RUN, and the node
+    answers with a FLEET_RESULT for each job and a FLEET_DONE. The payloads are...
+        FLEET_SETTINGS   "C16F", version (1), flags (bit 0: JIT, bit 1: tiered), lanes (0 for none),
+                         fusions (4 bytes), RAM seed (8), maxInstructions (8), sliceInstructions (8)
+        FLEET_HAVE       the 8-byte hashes of the images the jobs will use
+        FLEET_NEED       the ones the node doesn't have yet
+        FLEET_IMAGE      a hash (8), then the image file's bytes
+        FLEET_JOB        job number (4), image hash (8, or 0 for no image), input length (4), the input words
+        FLEET_RUN        nothing: run the jobs sent since the last FLEET_RUN
+        FLEET_RESULT     job number (4), 1 if halted (2), instructions (8), reg[0] to reg[15],
+                         output length (4), the output, error length (2), the error
+        FLEET_DONE       nothing: every job of the FLEET_RUN has its FLEET_RESULT
+        FLEET_ERROR      why the node is hanging up
+*/
+
+enum FleetFrame { FLEET_SETTINGS = 1, FLEET_HAVE, FLEET_NEED, FLEET_IMAGE, FLEET_JOB, FLEET_RUN, FLEET_RESULT, FLEET_DONE, FLEET_ERROR };
+
+const char fleetMagic[4] = { 'C', '1', '6', 'F' };
+const uint16_t fleetVersion = 1;
+const size_t fleetChunkJobs = 256;
+const uint32_t fleetMaxFrame = 1 << 28;   // anything claiming to be bigger isn't a frame from cpu16
+
+// FNV-1a, which tells images apart (but wouldn't stop anyone from making two with the same hash)
+uint64_t contentHash(const std::string &bytes) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (unsigned char c : bytes) {
+        hash ^= c;
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+void putFrame(std::string &frames, uint16_t type, const std::string &payload) {
+    putLittleEndian32(frames, payload.size() + 2);
+    putLittleEndian16(frames, type);
+    frames += payload;
+}
+
+// reads numbers out of a frame's payload, remembering whether it ran past the end
+struct FrameReader {
+    const std::string &payload;
+    size_t at = 0;
+    bool ok = true;
+
+    explicit FrameReader(const std::string &payload) : payload(payload) {}
+
+    const uint8_t *take(size_t n) {
+        if (!ok || payload.size() - at < n) {
+            ok = false;
+            return nullptr;
+        }
+        at += n;
+        return (const uint8_t *)payload.data() + at - n;
+    }
+
+    uint16_t get16() { const uint8_t *b = take(2); return b ? littleEndian16(b) : 0; }
+    uint32_t get32() { const uint8_t *b = take(4); return b ? littleEndian32(b) : 0; }
+    uint64_t get64() { const uint8_t *b = take(8); return b ? littleEndian64(b) : 0; }
+    std::string getBytes(size_t n) { const uint8_t *b = take(n); return b ? std::string((const char *)b, n) : std::string(); }
+    bool atEnd() const { return ok && at == payload.size(); }
+};
+
+// one end of a TCP connection between a coordinator and a node
+class FleetConnection {
+
+public:
+
+    explicit FleetConnection(int socket) : socket(socket) {
+        int yes = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+
+    ~FleetConnection() {
+        ::close(socket);
+    }
+
+    FleetConnection(const FleetConnection &) = delete;
+    FleetConnection &operator=(const FleetConnection &) = delete;
+
+    // connects to "host:port"
+    static std::unique_ptr<FleetConnection> connect(const std::string &node, std::string &error) {
+        size_t colon = node.rfind(':');
+        if (colon == std::string::npos) {
+            error = "nodes are HOST:PORT";
+            return nullptr;
+        }
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *found = nullptr;
+        if (getaddrinfo(node.substr(0, colon).c_str(), node.substr(colon + 1).c_str(), &hints, &found) != 0) {
+            error = "can't find " + node;
+            return nullptr;
+        }
+        int connected = -1;
+        for (addrinfo *a = found; a && connected < 0; a = a->ai_next) {
+            connected = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (connected >= 0 && ::connect(connected, a->ai_addr, a->ai_addrlen) != 0) {
+                ::close(connected);
+                connected = -1;
+            }
+        }
+        freeaddrinfo(found);
+        if (connected < 0) {
+            error = "can't connect to " + node;
+            return nullptr;
+        }
+        return std::unique_ptr<FleetConnection>(new FleetConnection(connected));
+    }
+
+    // sends frames made with putFrame() (from any thread)
+    bool send(const std::string &frames) {
+        std::lock_guard<std::mutex> guard(sendLock);
+        for (size_t sent = 0; sent < frames.size(); ) {
+            ssize_t n = ::send(socket, frames.data() + sent, frames.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            sent += n;
+        }
+        return true;
+    }
+
+    bool send(uint16_t type, const std::string &payload) {
+        std::string frame;
+        putFrame(frame, type, payload);
+        return send(frame);
+    }
+
+    // waits for the next frame (false if the connection is gone, or it isn't a frame)
+    bool receive(uint16_t &type, std::string &payload) {
+        uint8_t header[6];
+        if (!receiveAll(header, 6))
+            return false;
+        uint32_t length = littleEndian32(header);
+        if (length < 2 || length > fleetMaxFrame)
+            return false;
+        type = littleEndian16(header + 4);
+        payload.resize(length - 2);
+        return receiveAll((uint8_t *)&payload[0], payload.size());
+    }
+
+private:
+
+    int socket;
+    std::mutex sendLock;
+
+    bool receiveAll(uint8_t *bytes, size_t length) {
+        for (size_t got = 0; got < length; ) {
+            ssize_t n = recv(socket, bytes + got, length - got, 0);
+            if (n <= 0)
+                return false;
+            got += n;
+        }
+        return true;
+    }
+
+};
+
+std::string encodeResult(size_t job, const JobResult &result) {
+    std::string payload;
+    putLittleEndian32(payload, job);
+    putLittleEndian16(payload, result.halted);
+    putLittleEndian64(payload, result.instructions);
+    for (uint16_t r : result.reg)
+        putLittleEndian16(payload, r);
+    putLittleEndian32(payload, result.output.size());
+    payload += result.output;
+    putLittleEndian16(payload, std::min<size_t>(result.error.size(), 0xFFFF));
+    payload += result.error.substr(0, 0xFFFF);
+    return payload;
+}
+
+bool decodeResult(const std::string &payload, size_t &job, JobResult &result) {
+    FrameReader reader(payload);
+    job = reader.get32();
+    result.halted = reader.get16();
+    result.instructions = reader.get64();
+    for (uint16_t &r : result.reg)
+        r = reader.get16();
+    result.output = reader.getBytes(reader.get32());
+    result.error = reader.getBytes(reader.get16());
+    return reader.atEnd();
+}
+
+/*
+    The node's end: answers one coordinator at a time, for as long as it runs.
+    Images stay in images[] between coordinators.
 */
-uint16_t ROM[0xFFFF];
+class FleetWorker {
+
+public:
+
+    unsigned threads = std::thread::hardware_concurrency();
 
+    ~FleetWorker() {
+        if (listener >= 0)
+            ::close(listener);
+    }
+
+    bool listen(uint16_t port, std::string &error) {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int yes = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+        if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || ::listen(listener, 4) != 0) {
+            error = "can't listen on port " + std::to_string(port);
+            return false;
+        }
+        std::cerr << "waiting for coordinators on port " << port << std::endl;
+        return true;
+    }
+
+    void serve() {
+        for (;;) {
+            int socket = accept(listener, nullptr, nullptr);
+            if (socket < 0)
+                continue;
+            FleetConnection connection(socket);
+            std::string error;
+            if (!answer(connection, error) && !error.empty()) {
+                connection.send(FLEET_ERROR, error);
+                std::cerr << error << std::endl;
+            }
+        }
+    }
+
+private:
+
+    int listener = -1;
+    std::unordered_map< uint64_t, std::shared_ptr<const Image> > images;
+
+    // returns when the coordinator hangs up (with false and an error if it sent something wrong)
+    bool answer(FleetConnection &connection, std::string &error) {
+
+        BatchRunner runner;
+        runner.threads = threads;
+        runner.roms = std::make_shared<ROMCache>();   // (so each image is decoded once per connection, not once per chunk)
+        unsigned lanes = 0;
+        bool settled = false;
+        std::vector<Job> jobs;
+        std::vector<size_t> numbers;   // the coordinator's number for each of jobs[]
+
+        uint16_t type;
+        std::string payload;
+        while (connection.receive(type, payload)) {
+            FrameReader reader(payload);
+            if (type != FLEET_SETTINGS && !settled) {
+                error = "the coordinator didn't send its settings first";
+                return false;
+            }
+            switch (type) {
+
+              case FLEET_SETTINGS: {
+                settled = reader.getBytes(4) == std::string(fleetMagic, 4) && reader.get16() == fleetVersion;
+                uint16_t flags = reader.get16();
+                runner.useJit = flags & 1;
+                runner.tiered = flags & 2;
+#ifndef CPU16_THREADED
+                if (runner.tiered) {
+                    error = tieredNeedsThreaded;
+                    return false;
+                }
+#endif
+                lanes = reader.get16();
+                runner.fusions = reader.get32();
+                runner.ramSeed = reader.get64();
+                runner.maxInstructions = reader.get64();
+                runner.sliceInstructions = std::max<uint64_t>(1, reader.get64());
+                if (!settled || !reader.atEnd()) {
+                    error = "the coordinator is a different version of cpu16";
+                    return false;
+                }
+                break;
+              }
+
+              case FLEET_HAVE: {
+                std::string need;
+                while (reader.ok && !reader.atEnd()) {
+                    uint64_t hash = reader.get64();
+                    if (reader.ok && !images.count(hash))
+                        putLittleEndian64(need, hash);
+                }
+                if (!connection.send(FLEET_NEED, need))
+                    return true;
+                break;
+              }
+
+              case FLEET_IMAGE: {
+                uint64_t hash = reader.get64();
+                std::string bytes = reader.getBytes(payload.size() - reader.at);
+                if (!reader.ok || contentHash(bytes) != hash) {
+                    error = "an image came that doesn't match its hash";
+                    return false;
+                }
+                std::shared_ptr<const Image> image = Image::fromBytes(bytes, error);
+                if (!image)
+                    return false;
+                images[hash] = image;
+                break;
+              }
+
+              case FLEET_JOB: {
+                size_t number = reader.get32();
+                uint64_t hash = reader.get64();
+                Job job;
+                job.imageHash = hash;
+                job.input.resize(std::min<uint32_t>(reader.get32(), 0x10000));
+                for (uint16_t &word : job.input)
+                    word = reader.get16();
+                if (hash)
+                    job.image = images.count(hash) ? images[hash] : nullptr;
+                if (!reader.atEnd() || (hash && !job.image)) {
+                    error = "a job came for an image that never did";
+                    return false;
+                }
+                jobs.push_back(job);
+                numbers.push_back(number);
+                break;
+              }
+
+              case FLEET_RUN: {
+                if (lanes) {
+                    std::vector<JobResult> results;
+                    if (!runLanes(lanes, jobs, runner.maxInstructions, runner.ramSeed, results)) {
+                        error = "--lanes can be 8, 16 or 32";
+                        return false;
+                    }
+                    std::string frames;
+                    for (size_t j = 0; j < results.size(); j++)
+                        putFrame(frames, FLEET_RESULT, encodeResult(numbers[j], results[j]));
+                    connection.send(frames);
+                } else {
+                    runner.finished = [&](size_t job, const JobResult &result) {
+                        connection.send(FLEET_RESULT, encodeResult(numbers[job], result));
+                    };
+                    runner.run(jobs);
+                }
+                jobs.clear();
+                numbers.clear();
+                if (!connection.send(FLEET_DONE, std::string()))
+                    return true;
+                break;
+              }
+
+              default:
+                error = "the coordinator sent a frame this node doesn't know";
+                return false;
+
+            }
+        }
+        return true;
+
+    }
+
+};
 
 /*
-    RAM is where the program can read and write.
-    RAM is erased then randomly set whenever the emulated CPU is reset
-        (whenever you rerun this code).
-    0xFFFF = 2^16 = 65536 is the max that 16-bit addresses can address.
-    I decided to make a uint16_t (instead of a uint8_t) the fundamental memory chunk.
+    The coordinator's end: a thread for each node, each taking chunks of jobs until none are left.
 */
-uint16_t RAM[0xFFFF];
+class FleetCoordinator {
+
+public:
+
+    FleetCoordinator(const BatchRunner &settings, unsigned lanes) : settings(settings), lanes(lanes) {}
+
+    // runs jobs on nodes, returning false (and why) if it couldn't run them all
+    bool run(const std::vector<std::string> &nodes, const std::vector<Job> &jobList, std::vector<JobResult> &resultList, std::string &error) {
+
+        jobs = &jobList;
+        results = &resultList;
+        resultList.assign(jobList.size(), JobResult());
+        finished.assign(jobList.size(), false);
+        next = 0;
+        busy = 0;
+        retry.clear();
+        chunkJobs = std::max<size_t>(1, std::min(fleetChunkJobs, jobList.size() / (4 * std::max<size_t>(1, nodes.size()))));
+
+        for (const Job &job : jobList) {
+            if (job.snapshot) {
+                error = "jobs on nodes can't start from a snapshot";
+                return false;
+            }
+            if (job.image && !hashes.count(job.image.get())) {
+                std::string bytes;
+                if (!job.image->toBytes(bytes, error))
+                    return false;
+                uint64_t hash = contentHash(bytes);
+                hashes[job.image.get()] = hash;
+                imageBytes[hash] = bytes;
+            }
+        }
+
+        std::vector<std::thread> threads;
+        for (const std::string &node : nodes)
+            threads.emplace_back(&FleetCoordinator::drive, this, node);
+        for (std::thread &t : threads)
+            t.join();
+
+        size_t missing = std::count(finished.begin(), finished.end(), false);
+        for (size_t j = 0; j < jobList.size(); j++)
+            if (!finished[j])
+                resultList[j].error = "no node could run job " + std::to_string(j);
+        if (missing) {
+            error = std::to_string(missing) + " jobs didn't run";
+            return false;
+        }
+        return true;
+
+    }
+
+private:
+
+    const BatchRunner &settings;
+    unsigned lanes;
+    const std::vector<Job> *jobs = nullptr;
+    std::vector<JobResult> *results = nullptr;
+    std::vector<bool> finished;   // (only changed with lock held)
+    std::unordered_map<const Image *, uint64_t> hashes;
+    std::unordered_map<uint64_t, std::string> imageBytes;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    size_t next = 0;                   // the first job no node has been given
+    std::vector<size_t> retry;         // jobs a node went away with
+    unsigned busy = 0;                 // nodes running a chunk (which might come back for retry)
+    size_t chunkJobs = fleetChunkJobs;
+
+    // the next chunk of jobs, waiting while another node might still give some back (empty when there are none)
+    std::vector<size_t> takeChunk() {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this] { return !retry.empty() || next < jobs->size() || busy == 0; });
+        std::vector<size_t> chunk;
+        while (!retry.empty() && chunk.size() < chunkJobs) {
+            chunk.push_back(retry.back());
+            retry.pop_back();
+        }
+        for (; next < jobs->size() && chunk.size() < chunkJobs; next++)
+            chunk.push_back(next);
+        busy += !chunk.empty();
+        return chunk;
+    }
+
+    // a node is done with chunk (and gives back whatever it didn't finish)
+    void returnChunk(const std::vector<size_t> &chunk) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t j : chunk)
+            if (!finished[j])
+                retry.push_back(j);
+        busy--;
+        changed.notify_all();
+    }
+
+    // what every node hears first: the settings, and which images it needs
+    bool introduce(FleetConnection &connection, std::string &error) {
+        std::string payload(fleetMagic, 4);
+        putLittleEndian16(payload, fleetVersion);
+        putLittleEndian16(payload, (settings.useJit ? 1 : 0) | (settings.tiered ? 2 : 0));
+        putLittleEndian16(payload, lanes);
+        putLittleEndian32(payload, settings.fusions);
+        putLittleEndian64(payload, settings.ramSeed);
+        putLittleEndian64(payload, settings.maxInstructions);
+        putLittleEndian64(payload, settings.sliceInstructions);
+        std::string have;
+        for (const std::pair<const uint64_t, std::string> &image : imageBytes)
+            putLittleEndian64(have, image.first);
+        std::string frames;
+        putFrame(frames, FLEET_SETTINGS, payload);
+        putFrame(frames, FLEET_HAVE, have);
+
+        uint16_t type = 0;
+        if (!connection.send(frames) || !connection.receive(type, payload) || type != FLEET_NEED) {
+            error = (type == FLEET_ERROR) ? payload : "it hung up";
+            return false;
+        }
+        frames.clear();
+        FrameReader reader(payload);
+        while (reader.ok && !reader.atEnd()) {
+            uint64_t hash = reader.get64();
+            if (reader.ok && imageBytes.count(hash)) {
+                std::string image;
+                putLittleEndian64(image, hash);
+                putFrame(frames, FLEET_IMAGE, image + imageBytes[hash]);
+            }
+        }
+        return frames.empty() || connection.send(frames);
+    }
+
+    // sends a chunk of jobs, and collects their results as they come
+    bool runChunk(FleetConnection &connection, const std::vector<size_t> &chunk, size_t &ran, std::string &error) {
+        std::string frames;
+        for (size_t j : chunk) {
+            const Job &job = (*jobs)[j];
+            std::string payload;
+            putLittleEndian32(payload, j);
+            putLittleEndian64(payload, job.image ? hashes[job.image.get()] : 0);
+            putLittleEndian32(payload, job.input.size());
+            for (uint16_t word : job.input)
+                putLittleEndian16(payload, word);
+            putFrame(frames, FLEET_JOB, payload);
+        }
+        putFrame(frames, FLEET_RUN, std::string());
+        if (!connection.send(frames)) {
+            error = "it hung up";
+            return false;
+        }
+
+        uint16_t type;
+        std::string payload;
+        while (connection.receive(type, payload)) {
+            if (type == FLEET_DONE)
+                return true;
+            size_t j;
+            JobResult result;
+            if (type == FLEET_ERROR) {
+                error = payload;
+                return false;
+            }
+            if (type != FLEET_RESULT || !decodeResult(payload, j, result) || j >= jobs->size()) {
+                error = "it sent something that isn't a result";
+                return false;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            if (!finished[j]) {
+                (*results)[j] = result;
+                finished[j] = true;
+                ran++;
+            }
+        }
+        error = "it hung up";
+        return false;
+    }
+
+    void drive(const std::string &node) {
+        std::string error;
+        size_t ran = 0;
+        std::unique_ptr<FleetConnection> connection = FleetConnection::connect(node, error);
+        if (connection && !introduce(*connection, error))
+            connection.reset();
+        while (connection) {
+            std::vector<size_t> chunk = takeChunk();
+            if (chunk.empty())
+                break;
+            if (!runChunk(*connection, chunk, ran, error))
+                connection.reset();
+            returnChunk(chunk);
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        if (error.empty())
+            std::cerr << node << " ran " << ran << " jobs" << std::endl;
+        else
+            std::cerr << node << ": " << error << " (after " << ran << " jobs)" << std::endl;
+    }
+
+};
+
+
+
 
 
 /*
-    Register must be uint16_t since this is a 16-bit computer!
-        reg[0] is program counter
-        reg[1] is flags
-        reg[2] is register 2
-        reg[3] is register 3
-        reg[4] is register 4
-    Feel free to make more registers! No more than 16 for compatibility with my default instruction set.
+    Every faster way of running instructions has to do exactly what the plain interpreter does,
+    and a bug in one (a superinstruction that forgets a flag, a JIT'd store to the wrong page...)
+    might only show up millions of instructions in. To check a backend against the interpreter...
+        ./cpu16 --check jit prog.img
+    runs the program on 2 Cpus side by side: the "reference", which runs every instruction with
+    runInstruction() (straight from ROM, with no DecodedOps, blocks or lazy flags to get wrong),
+    and one running it the fast way...
+        threaded    --> runThreaded(), without superinstructions
+        fused       --> runThreaded(), with them
+        jit         --> runJit()
+        tiered      --> runTiered()
+        lanes16     --> a LaneCpu<16>, with every lane running the program
+    Every checkInstructions instructions they're compared: registers (with the flags worked out),
+    halt, cycles (except for lanes), what OUT printed, and each page of RAM either one wrote
+    since the last check (or all of RAM, for lanes, which don't keep track).
+    Then both take a Snapshot, which is where they go back to if the next check finds a difference.
+    That's cheap enough to leave on in long soak runs: it costs about what the interpreter does.
 
-    All are initialized to 0
+    When they differ, both go back to the last Snapshot and run again a basic block at a time
+    (see endsBlock()), comparing after each, to find the first block that goes wrong.
+    Then the reference runs that block again one instruction at a time, to print what
+    it should have done (the "minimal trace"), followed by the differences...
+        0012: 0234 0000  ADD  reg[4] = 13
+        0014: 7400       OUT  prints 13
+        the first difference is in the block at 0x0012, 1048593 instructions in:
+          reg[4] is 12 with fused, but 13 with the reference
+    What the reference prints goes to the output as usual, a check at a time.
+    Devices aren't checked, since each Cpu would need its own (which would need to agree).
 */
-uint16_t reg[5] = {0};
 
+enum CheckBackend { CHECK_THREADED, CHECK_FUSED, CHECK_JIT, CHECK_TIERED, CHECK_LANES };
 
+// keeps every value OUT sends, so 2 Cpus' outputs can be compared
+class RecordingSink : public OutputSink {
+public:
+    std::vector<uint16_t> values;
+    void write(uint16_t value) override { values.push_back(value); }
+};
 
+class CoSimulator {
 
-/*
-    My instructions in machine code will all be 2 uint16_t values...
-      (1) first uint16_t specifies opcode (4 bits) and up to 3 modes, registers, or flags (4 bits each)
-      (2) many instructions will require a uint16_t RAM or ROM address
-    Feel free to change these conventions!
+public:
 
-    Assembly code for my instruction set of 4-bit opcodes...
-        0:  ADD A B C    --> add registers A and B; store in register C
-        1:  SUB A B C    --> subtract register B from register A; store in register C
-        2:  NOT A        --> inverts the contents of register A
-        3:  AND A B      --> set flag based on (A and B)
-        4:  OR A B       --> set flag based on (A or B)
-        5:  CMP A B      --> set flags by comparing registers A to B
-        6:  CPY A B      --> copy register A to B
-        7:  OUT A        --> prints register A
-        8:  MOV A, RAM   --> copy register A to RAM address
-        9:  LD A, RAM    --> copy value in RAM address to register A
-        A:  LDV A, VAL   --> copy value (in ROM) to register A
-        B:
-        C:
-        D:
-        E:  J MODE FLAG, ROM --> jump program counter to ROM address if FLAG is...
-              0  <-- MODE = 0
-              1  <-- MODE = 1
-              either  <-- MODE = 2
-        F:  HLT          --> halt until CPU is reset
-    Feel free to change the above!
+    uint64_t checkInstructions = 1 << 16;   // instructions between checks
+    uint64_t maxInstructions = UINT64_MAX;
+    uint64_t instructions = 0;              // how many have been checked
+    uint64_t checks = 0;
+    OutputSink *output = nullptr;           // gets what the reference prints
 
-    Maybe CMP and OUT commands could have an option to interpret the integers as *signed*?
-    If I didn't want to cast to the int16_t type and just use uint16_t instead... 
-     - ADD and SUB don't need to be changed because two's complement signed integers
-        add and subtract exactly like unsigned integers.
-     - To compare, equality is the same, but comparing numbers with different sign bits is different:
-        the number with the sign bit is always smaller than the other one.
-     - To output a negative number, the sign bit (1) prints a negative sign
-        then (2) prints (32768 - (number in remaining 15 bits))
+    static bool parseBackend(const std::string &name, CheckBackend &backend) {
+        const char *names[] = {"threaded", "fused", "jit", "tiered", "lanes16"};
+        for (int i = 0; i <= CHECK_LANES; i++)
+            if (name == names[i]) {
+                backend = (CheckBackend)i;
+                return true;
+            }
+        return false;
+    }
 
-    To get floating point numbers, half-precision (FP16) is not implemented on modern CPUs,
-    so emulating this would be difficult!
+    bool load(const Image &image, const Snapshot *snapshot, CheckBackend which, uint64_t ramSeed, std::string &error) {
+        const char *names[] = {"threaded", "fused", "jit", "tiered", "lanes16"};
+        backend = which;
+        backendName = names[which];
+#ifndef CPU16_THREADED
+        if (backend == CHECK_TIERED) {
+            error = tieredNeedsThreaded;
+            return false;
+        }
+#endif
+        this->image = &image;
+        reference.reset(new Cpu);
+        reference->RAM.reset(ramSeed);
+        if (!reference->loadImage(image, error))
+            return false;
+        if (snapshot)
+            reference->restoreSnapshot(*snapshot);
+        reference->output = &referenceOutput;
+        if (backend == CHECK_LANES) {
+            lanes.reset(new LaneCpu<16>);
+            lanes->ramSeed = ramSeed;
+            return loadLanes(snapshot, error);
+        }
+        fast.reset(new Cpu);
+        fast->RAM.reset(ramSeed);
+        if (!fast->loadImage(image, error))
+            return false;
+        if (snapshot)
+            fast->restoreSnapshot(*snapshot);
+        fast->setFusions(backend == CHECK_THREADED ? 0 : fuseAll);
+        fast->useJit = backend == CHECK_JIT;
+        fast->tiered = backend == CHECK_TIERED;
+        fast->output = &fastOutput[0];
+        return true;
+    }
 
-    Examples in assembly code and machine code (* means the nibble is irrelevant)...
-        ADD 2 3 4        --> adds registers 2 and 3 into 4
-            0x0234
-            0x****
-        MOV 4, 0x0000    --> copies register 4 to RAM[0x0000]
-            0x84**
-            0x0000
-        LDV 3, 0x0001    --> copies 0x0001 from ROM into register 3
-            0xA3**
-            0x0001
-        J 1 2, 0x0000    --> sets program counter to 0x0000 if flag register's bit2 is 1
-            0xE12*
-            0x0000
-        HLT
-            0xF***
-            0x****
+    // runs until the program halts (or runs maxInstructions), returning false with a report if the backend went wrong
+    bool run(std::string &report) {
+        checkpoint(lastCheck);
+        while (!reference->halt && instructions < maxInstructions) {
+            uint64_t ran = runReference(std::min(checkInstructions, maxInstructions - instructions));
+            runFast(ran);
+            if (!compare().empty()) {
+                report = findDivergence();
+                return false;
+            }
+            instructions += ran;
+            checks++;
+            checkpoint(lastCheck);
+        }
+        output->flush();
+        return true;
+    }
 
-    If you wanted, you could also create lines of assembly that are not CPU instructions!
-    For example...
-            SET VAL ROM
-    which could store data in ROM at assembly time.
+private:
+
+    // the reference's and the backend's state at the last check (or the start of a block)
+    struct Checkpoint {
+        Snapshot reference, fast;
+    };
+
+    CheckBackend backend = CHECK_THREADED;
+    const char *backendName = "";
+    const Image *image = nullptr;
+    std::unique_ptr<Cpu> reference, fast;
+    std::unique_ptr< LaneCpu<16> > lanes;
+    RecordingSink referenceOutput, fastOutput[16];
+    Checkpoint lastCheck;
+
+    bool loadLanes(const Snapshot *snapshot, std::string &error) {
+        if (!lanes->load(image, snapshot, error))
+            return false;
+        for (int l = 0; l < 16; l++)
+            lanes->output[l] = &fastOutput[l];
+        return true;
+    }
+
+    uint64_t runReference(uint64_t count, std::vector<std::string> *trace = nullptr) {
+        Cpu &cpu = *reference;
+        uint64_t ran = 0;
+        for (; ran < count && !cpu.halt; ran++) {
+            uint16_t pc = cpu.reg[0];
+            if (!trace) {
+                cpu.runInstruction(cpu.readROM(pc), cpu.readROM((uint16_t)(pc + 1)));
+                continue;
+            }
+            DecodedOp op = cpu.decodeAt(pc);
+            uint16_t before[16];
+            std::copy(cpu.reg, cpu.reg + 16, before);
+            size_t printed = referenceOutput.values.size();
+            cpu.runInstruction(cpu.readROM(pc), cpu.readROM((uint16_t)(pc + 1)));
+            char line[160];
+            int n = (op.words == 2)
+                ? std::snprintf(line, sizeof(line), "%04x: %04x %04x  %s", pc, cpu.readROM(pc), cpu.readROM((uint16_t)(pc + 1)), opcodeNames[op.opcode])
+                : std::snprintf(line, sizeof(line), "%04x: %04x       %s", pc, cpu.readROM(pc), opcodeNames[op.opcode]);
+            for (int r = 1; r < 16; r++)
+                if (cpu.reg[r] != before[r])
+                    n += std::snprintf(line + n, sizeof(line) - n, "  reg[%d] = %u", r, cpu.reg[r]);
+            if (op.opcode == 0x8)
+                n += std::snprintf(line + n, sizeof(line) - n, "  RAM[%04x] = %u", op.address, before[op.a]);
+            if (referenceOutput.values.size() > printed)
+                n += std::snprintf(line + n, sizeof(line) - n, "  prints %u", referenceOutput.values.back());
+            if (cpu.reg[0] != (uint16_t)(pc + op.words))
+                std::snprintf(line + n, sizeof(line) - n, "  to %04x", cpu.reg[0]);
+            trace->push_back(line);
+        }
+        return ran;
+    }
+
+    void runFast(uint64_t count) {
+        if (lanes) {
+            while (count)
+                if (uint64_t ran = lanes->run(count))
+                    count -= ran;
+                else
+                    break;
+            return;
+        }
+        while (count && !fast->halt)
+            if (uint64_t ran = fast->runBatch(count))
+                count -= ran;
+            else
+                break;
+    }
+
+    // how the backend differs from the reference since the last checkpoint (nothing if it doesn't)
+    std::string compare() {
+        std::ostringstream differences;
+        auto differ = [&](const std::string &what, uint64_t got, uint64_t expected) {
+            if (got != expected)
+                differences << "  " << what << " is " << got << " with " << backendName << ", but " << expected << " with the reference\n";
+        };
+        Cpu &cpu = *reference;
+        if (lanes) {
+            for (int l = 0; l < 16; l++) {
+                std::string lane = "lane " + std::to_string(l) + "'s ";
+                for (int r = 0; r < 16; r++)
+                    differ(lane + "reg[" + std::to_string(r) + "]", lanes->reg[r][l], cpu.reg[r]);
+                differ(lane + "halt", lanes->halt[l], cpu.halt);
+                compareOutput(differences, lane, fastOutput[l].values);
+            }
+            // (only the first word of RAM that's different, which is enough to go on)
+            for (uint32_t a = 0; a < 0x10000; a++) {
+                uint16_t expected = cpu.RAM.read(a);
+                const std::array<uint16_t, 16> &got = lanes->RAM[a];
+                if (std::all_of(got.begin(), got.end(), [&](uint16_t word) { return word == expected; }))
+                    continue;
+                char what[32];
+                for (int l = 0; l < 16; l++) {
+                    std::snprintf(what, sizeof(what), "lane %d's RAM[%04x]", l, a);
+                    differ(what, got[l], expected);
+                }
+                break;
+            }
+            return differences.str();
+        }
+        for (int r = 0; r < 16; r++)
+            differ("reg[" + std::to_string(r) + "]", fast->reg[r], cpu.reg[r]);
+        differ("halt", fast->halt, cpu.halt);
+        differ("cycles", fast->cycles, cpu.cycles);
+        for (int p = 0; p < 256; p++)
+            if (fast->ramDirty[p] || cpu.ramDirty[p])
+                for (uint32_t a = p << 8; a < (uint32_t)(p + 1) << 8; a++)
+                    if (fast->RAM.read(a) != cpu.RAM.read(a)) {
+                        char what[32];
+                        std::snprintf(what, sizeof(what), "RAM[%04x]", a);
+                        differ(what, fast->RAM.read(a), cpu.RAM.read(a));
+                    }
+        compareOutput(differences, "", fastOutput[0].values);
+        return differences.str();
+    }
+
+    void compareOutput(std::ostringstream &differences, const std::string &lane, const std::vector<uint16_t> &values) {
+        const std::vector<uint16_t> &expected = referenceOutput.values;
+        size_t i = std::mismatch(values.begin(), values.begin() + std::min(values.size(), expected.size()), expected.begin()).first - values.begin();
+        if (i < values.size() && i < expected.size())
+            differences << "  " << lane << "output " << i << " is " << values[i] << " with " << backendName
+                        << ", but " << expected[i] << " with the reference\n";
+        else if (values.size() != expected.size())
+            differences << "  " << lane << "output has " << values.size() << " values with " << backendName
+                        << ", but " << expected.size() << " with the reference\n";
+    }
+
+    // passes on what the reference printed, then saves both where they are (which clears their RAM's dirty pages)
+    void checkpoint(Checkpoint &at) {
+        for (uint16_t value : referenceOutput.values)
+            output->write(value);
+        referenceOutput.values.clear();
+        reference->takeSnapshot(at.reference);
+        for (RecordingSink &sink : fastOutput)
+            sink.values.clear();
+        if (!lanes)
+            fast->takeSnapshot(at.fast);
+    }
+
+    // puts both back where they were at a checkpoint (forgetting what they printed since)
+    void rewind(const Checkpoint &at) {
+        reference->restoreSnapshot(at.reference);
+        referenceOutput.values.clear();
+        for (RecordingSink &sink : fastOutput)
+            sink.values.clear();
+        if (lanes) {
+            // every lane was the same as the reference at a checkpoint (or compare() would have said)
+            std::string error;
+            loadLanes(&at.reference, error);
+        } else {
+            fast->restoreSnapshot(at.fast);
+        }
+    }
+
+    // how many instructions the reference would run from pc through the end of its basic block
+    uint64_t blockAt(uint16_t pc) const {
+        uint64_t n = 0;
+        for (;;) {
+            DecodedOp op = reference->decodeAt(pc);
+            n++;
+            if (endsBlock(op) || n == 255)
+                return n;
+            pc += op.words;
+        }
+    }
 
+    // goes back to the last check and runs again a block at a time, to say where the backend first went wrong
+    // (what the reference prints before that block is passed on, since it's right)
+    std::string findDivergence() {
+        rewind(lastCheck);
+        Checkpoint block;
+        uint64_t at = instructions;
+        while (!reference->halt && at - instructions <= checkInstructions) {
+            checkpoint(block);
+            uint16_t pc = reference->reg[0];
+            uint64_t ran = runReference(blockAt(pc));
+            runFast(ran);
+            std::string differences = compare();
+            if (differences.empty()) {
+                at += ran;
+                continue;
+            }
+            output->flush();
+            rewind(block);
+            std::vector<std::string> trace;
+            runReference(ran, &trace);
+            std::ostringstream report;
+            for (const std::string &line : trace)
+                report << line << "\n";
+            char where[64];
+            std::snprintf(where, sizeof(where), "the first difference is in the block at 0x%04x, ", pc);
+            report << where << at << " instructions in:\n" << differences;
+            return report.str();
+        }
+        output->flush();
+        return "the backend differed from the reference after the check at " + std::to_string(instructions)
+               + " instructions, but not when run again a block at a time\n";
+    }
+
+};
+
+
+
+
+
+/*
+    How fast is this emulator, really? Find out with...
+        ./cpu16 --bench
+    which runs a few little programs ("kernels"), each for a fixed number of instructions,
+    on every way of running instructions that your build has...
+        switch, threaded, jit, and profiled (the switch while counting everything)
+    plus lanes16, a LaneCpu running 16 copies at once (counting every copy's instructions)
+    and prints how many millions of emulated instructions run per second (MIPS).
+    Each is run a few times and the fastest is kept, since other things your computer is doing
+    can only make it slower. Run it again after changing this code to see if you made it faster!
+    The first line says how this code was compiled, since that matters just as much.
+
+    A kernel that halts before running all of its instructions (maybe it uses an instruction
+    that isn't implemented) is reported as halted instead of getting a speed.
 */
 
-bool halt = false;
+struct BenchKernel {
+    const char *name;
+    const char *source;
+};
 
-void runInstruction(uint16_t instruction, uint16_t address) {
+const BenchKernel benchKernels[] = {
 
-    uint16_t n1,n2,n3,n4;
-    n1 = getNibble1(instruction);   // opcode
-    n2 = getNibble2(instruction);
-    n3 = getNibble3(instruction);
-    n4 = getNibble4(instruction);
+    { "alu_loop",
+        "        LDV 3, 1\n"
+        "        LDV 4, 1000\n"
+        "loop:   ADD 2 3 2\n"
+        "        CMP 2 4\n"
+        "        J 0 1, loop\n"
+        "        LDV 2, 0\n"
+        "        J 2 0, loop\n" },
 
-    reg[0] += 2;  // program counter increments to next instruction
+    { "memory_loop",
+        "        LDV 3, 1\n"
+        "loop:   MOV 2, 0x0100\n"
+        "        LD 4, 0x0100\n"
+        "        ADD 4 3 2\n"
+        "        MOV 2, 0x0200\n"
+        "        LD 4, 0x0200\n"
+        "        J 2 0, loop\n" },
 
-    switch (n1) {
+    { "out_loop",
+        "        LDV 3, 1\n"
+        "loop:   ADD 2 3 2\n"
+        "        OUT 2\n"
+        "        J 2 0, loop\n" },
 
-      /* ADD */
-      case 0x0:
-        reg[n4] = reg[n2] + reg[n3];
-        break;
+    // x = 5x + 13849 makes a pseudo-random pattern of branches
+    { "branchy",
+        "        LDV 2, 12345\n"
+        "        LDV 3, 0x8000\n"
+        "loop:   ADD 2 2 4\n"
+        "        ADD 4 4 4\n"
+        "        ADD 4 2 2\n"
+        "        LDV 4, 13849\n"
+        "        ADD 2 4 2\n"
+        "        CMP 2 3\n"
+        "        J 1 0, high\n"
+        "        CPY 2 4\n"
+        "        J 2 0, loop\n"
+        "high:   CPY 3 4\n"
+        "        J 2 0, loop\n" },
 
-      /* CMP */
-      case 0x5:
-        setbit(reg[1], 0, 0);
-        setbit(reg[1], 1, 0);
-        setbit(reg[1], 2, 0);
-        if (reg[n2] > reg[n3])
-            setbit(reg[1], 0, 1);
-        else if (reg[n2] == reg[n3])
-            setbit(reg[1], 1, 1);
-        else if (reg[n2] < reg[n3])
-            setbit(reg[1], 2, 1);
-        break;
+};
 
-      /* CPY */
-      case 0x6:
-        reg[n3] = reg[n2];
-        break;
+std::string buildDescription() {
+    std::string text;
+#if defined(__clang__)
+    text += std::string("clang ") + __clang_version__;
+#elif defined(__GNUC__)
+    text += std::string("g++ ") + __VERSION__;
+#else
+    text += "unknown compiler";
+#endif
+#ifdef __OPTIMIZE__
+    text += ", optimized";
+#else
+    text += ", not optimized";
+#endif
+#ifdef CPU16_THREADED
+    text += ", threaded dispatch";
+#else
+    text += ", switch dispatch";
+#endif
+#ifdef CPU16_JIT
+    text += ", JIT";
+#else
+    text += ", no JIT";
+#endif
+#ifdef CPU16_NO_PROFILE
+    text += ", no profiling";
+#endif
+    return text;
+}
 
-      /* OUT */
-      case 0x7:
-        std::cout << reg[n2] << std::endl;
-        break;
+int runBenchmarks(uint64_t instructions) {
 
-      /* LDV */
-      case 0xA:
-        reg[n2] = address;
-        break;
+    enum Backend { BENCH_SWITCH, BENCH_THREADED, BENCH_JIT, BENCH_TIERED, BENCH_PROFILED, BENCH_LANES };
+    std::vector< std::pair<Backend, const char *> > backends;
+    backends.push_back(std::make_pair(BENCH_SWITCH, "switch"));
+#ifdef CPU16_THREADED
+    backends.push_back(std::make_pair(BENCH_THREADED, "threaded"));
+#endif
+#ifdef CPU16_JIT
+    backends.push_back(std::make_pair(BENCH_JIT, "jit"));
+#ifdef CPU16_THREADED
+    backends.push_back(std::make_pair(BENCH_TIERED, "tiered"));
+#endif
+#endif
+#ifndef CPU16_NO_PROFILE
+    backends.push_back(std::make_pair(BENCH_PROFILED, "profiled"));
+#endif
+    backends.push_back(std::make_pair(BENCH_LANES, "lanes16"));
 
-      /* J */
-      case 0xE:
-        if (!n2) {
-            if (!getbit(reg[1], n3))  reg[0] = address;
-        } else if (n2 == 1) {
-            if (getbit(reg[1], n3))  reg[0] = address;
-        } else {
-            reg[0] = address;
+    std::cout << buildDescription() << "\n" << instructions << " instructions per run, best of 3\n\n";
+
+    std::ostream nowhere(nullptr);   // throws away what OUT prints
+    TextSink discard(nowhere);
+    std::unique_ptr<Cpu> cpu(new Cpu);
+    std::unique_ptr< LaneCpu<16> > lanes(new LaneCpu<16>);
+    Profile profile;
+
+    for (const BenchKernel &kernel : benchKernels) {
+
+        Image image;
+        std::string error;
+        if (!Assembler().assemble(kernel.source, image, error)) {
+            std::cerr << kernel.name << ": " << error << std::endl;
+            return 1;
         }
-        break;
 
-      /* undefined instructions are HLT */
-      default:
-        halt = true;
-        break;
+        for (const std::pair<Backend, const char *> &backend : backends) {
+
+            double best = 0;
+            uint64_t ran = 0;
+            for (int run = 0; run < 3; run++) {
+                ran = 0;
+                cpu.reset(new Cpu);
+                cpu->loadImage(image, error);
+                cpu->output = &discard;
+                cpu->useJit = (backend.first == BENCH_JIT);
+                cpu->tiered = (backend.first == BENCH_TIERED);
+                cpu->profile = (backend.first == BENCH_PROFILED) ? &profile : nullptr;
+                cpu->predecodeROM();
+
+                if (backend.first == BENCH_LANES) {
+                    lanes->load(&image, nullptr, error);
+                    std::fill(lanes->output, lanes->output + 16, &discard);
+                }
+
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                if (backend.first == BENCH_SWITCH)
+                    ran = cpu->runSwitch(instructions);
+                else if (backend.first == BENCH_LANES)
+                    for (uint64_t steps = 1; ran < instructions && steps; ran += steps * 16)   // every lane runs every instruction
+                        steps = lanes->run((instructions - ran) / 16);
+                else
+                    ran = cpu->runBatch(instructions);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (run == 0 || seconds < best)
+                    best = seconds;
+            }
+
+            std::string label = std::string(kernel.name) + "/" + backend.second;
+            std::cout << label << std::string(label.size() < 24 ? 24 - label.size() : 1, ' ');
+            if (ran < instructions)
+                std::cout << "halted after " << ran << " instructions\n";
+            else
+                std::cout << std::fixed << std::setprecision(2) << std::setw(8) << best * 1e9 / ran << " ns/instruction"
+                          << std::setw(10) << ran / best / 1e6 << " MIPS\n";
+
+        }
+
+    }
+    return 0;
+
+}
 
+
+
+
+
+void runClocked(Cpu &cpu, const Clock &clock) {
+
+    if (clock.mode == CLOCK_STEP) {
+        TimeMachine machine(cpu);
+        std::vector<bool> breakpoints(0x10000);
+        std::string line;
+        for (;;) {
+            cpu.output->flush();
+            printRegisters(cpu);
+            if (!std::getline(std::cin, line) || line == "q")
+                return;
+            std::istringstream words(line);
+            std::string command, number;
+            words >> command >> number;
+            uint64_t n = std::strtoull(number.c_str(), nullptr, 0);
+            if (command.empty() || command == "s") {
+                if (cpu.halt)
+                    return;
+                machine.run(1);
+                continue;
+            } else if (command == "c") {
+                machine.runToBreakpoint(breakpoints, UINT64_MAX);
+            } else if (command == "b" && !number.empty() && n < 0x10000) {
+                breakpoints[n] = !breakpoints[n];
+                std::cout << (breakpoints[n] ? "breakpoint at " : "no breakpoint at ") << n << '\n';
+                continue;
+            } else if (command == "rs") {
+                machine.reverseStep();
+            } else if (command == "rc") {
+                if (!machine.reverseContinue(breakpoints))
+                    std::cout << "no breakpoint was reached before then\n";
+            } else if (command == "g" && !number.empty()) {
+                machine.seek(n);
+            } else {
+                std::cout << "commands: (Enter) or s, c, b ADDRESS, rs, rc, g INSTRUCTION, q\n";
+                continue;
+            }
+            cpu.output->flush();
+            std::cout << "at instruction " << machine.now() << (cpu.halt ? " (halted)" : "") << '\n';
+        }
+    }
+
+    if (clock.mode == CLOCK_TURBO) {
+        while (cpu.run(1 << 16) == RUN_BUDGET)
+            ;
+        return;
+    }
+
+    uint64_t batch = (uint64_t)(clock.cyclesPerSecond / 1000);
+    if (batch < 1)
+        batch = 1;
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const uint64_t firstCycle = cpu.cycles;
+    while (cpu.runUntil(StopWhen().atCycle(cpu.cycles + batch)) == RUN_REACHED_CYCLE) {
+        cpu.output->flush();   // so you see each value when it happens
+        std::this_thread::sleep_until( start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>((cpu.cycles - firstCycle) / clock.cyclesPerSecond) ) );
+    }
+
+}
+
+// parses a rate like 20, 2.5k, or 1M
+bool parseRate(const std::string &text, double &rate) {
+    char *end = nullptr;
+    rate = std::strtod(text.c_str(), &end);
+    std::string suffix(end);
+    if (suffix == "k" || suffix == "K")
+        rate *= 1e3;
+    else if (suffix == "M")
+        rate *= 1e6;
+    else if (!suffix.empty())
+        return false;
+    return end != text.c_str() && rate > 0;
+}
+
+bool hasExtension(const std::string &path, const std::string &extension) {
+    return path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+// CSV if the file name ends in .csv, otherwise JSON
+bool writeProfile(const Profile &profile, const std::string &path) {
+    std::ofstream file(path);
+    if (hasExtension(path, ".csv"))
+        profile.writeCSV(file);
+    else
+        profile.writeJSON(file);
+    if (!file) {
+        std::cerr << "can't write " << path << std::endl;
+        return false;
     }
+    return true;
+}
 
+void printUsage(const char *program) {
+    std::cerr << "usage: " << program << " [--turbo | --rate CYCLES_PER_SECOND | --step] [--jit | --tiered] [--ram-seed SEED] [--output text|binary] [--profile FILE]"
+              << " [--fuse all|none|profile] [--devices] [--restore SNAPSHOT] [--snapshot-after INSTRUCTIONS SNAPSHOT] [--trace FILE] [--gdb PORT] [--cfg] [--check threaded|fused|jit|tiered|lanes16] [--batch COPIES [--threads THREADS | --lanes 8|16|32] [--nodes HOST:PORT,...]] [--save-image FILE] [IMAGE_OR_ASSEMBLY_FILE...]"
+              << "\n       " << program << " --worker PORT [--threads THREADS]"
+              << "\n       " << program << " --read-trace FILE"
+              << "\n       " << program << " --bench" << std::endl;
 }
 
 
 
 
 
-int main() {
+// (cpu16_test.cpp includes this whole file, so it defines CPU16_NO_MAIN to bring its own main())
+#ifndef CPU16_NO_MAIN
+
+int main(int argc, char *argv[]) {
+
+    static Cpu cpu;   // static because it's too big for the stack
+    Clock clock;
+    BatchRunner batch;
+    size_t batchJobs = 0;
+    BinarySink binaryOutput(std::cout);
+    std::vector< std::shared_ptr<const Image> > images;
+    std::string saveImage;
+    std::string profilePath;
+    Profile profile;
+    bool devices = false;
+    std::string fuse = "all";
+    unsigned lanes = 0;
+    std::shared_ptr<const Snapshot> restore;
+    uint64_t snapshotAfter = 0;
+    std::string snapshotPath;
+    std::string tracePath;
+    unsigned gdbPort = 0;
+    bool showGraph = false;
+    std::string check;
+    CheckBackend checkBackend = CHECK_THREADED;
+    std::vector<std::string> nodes;
+    unsigned workerPort = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--turbo") {
+            clock.mode = CLOCK_TURBO;
+        } else if (arg == "--step") {
+            clock.mode = CLOCK_STEP;
+        } else if (arg == "--jit") {
+            cpu.useJit = true;
+            batch.useJit = true;
+        } else if (arg == "--tiered") {
+#ifndef CPU16_THREADED
+            std::cerr << tieredNeedsThreaded << std::endl;
+            return 1;
+#endif
+            cpu.tiered = true;
+            batch.tiered = true;
+        } else if (arg == "--ram-seed" && i + 1 < argc) {
+            batch.ramSeed = std::strtoull(argv[++i], nullptr, 0);
+            cpu.RAM.reset(batch.ramSeed);
+        } else if (arg == "--output" && i + 1 < argc && (argv[i+1] == std::string("text") || argv[i+1] == std::string("binary"))) {
+            if (argv[++i] == std::string("binary"))
+                cpu.output = &binaryOutput;
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batchJobs = std::strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            batch.threads = std::strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--lanes" && i + 1 < argc) {
+            lanes = std::strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--nodes" && i + 1 < argc) {
+            std::istringstream list(argv[++i]);
+            std::string node;
+            while (std::getline(list, node, ','))
+                if (!node.empty())
+                    nodes.push_back(node);
+        } else if (arg == "--worker" && i + 1 < argc) {
+            workerPort = std::strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--rate" && i + 1 < argc && parseRate(argv[i+1], clock.cyclesPerSecond)) {
+            clock.mode = CLOCK_RATE;
+            i++;
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profilePath = argv[++i];
+#ifdef CPU16_NO_PROFILE
+            std::cerr << "profiling was compiled out (-DCPU16_NO_PROFILE), so the profile will be empty" << std::endl;
+#endif
+            cpu.profile = &profile;
+            batch.profile = &profile;
+        } else if (arg == "--fuse" && i + 1 < argc && (argv[i+1] == std::string("all") || argv[i+1] == std::string("none")
+                                                        || argv[i+1] == std::string("profile"))) {
+            fuse = argv[++i];
+        } else if (arg == "--devices") {
+            devices = true;
+        } else if (arg == "--restore" && i + 1 < argc) {
+            std::string error;
+            restore = Snapshot::open(argv[++i], error);
+            if (!restore) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+        } else if (arg == "--snapshot-after" && i + 2 < argc) {
+            snapshotAfter = std::strtoull(argv[++i], nullptr, 0);
+            snapshotPath = argv[++i];
+        } else if (arg == "--gdb" && i + 1 < argc) {
+            gdbPort = std::strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--cfg") {
+            showGraph = true;
+        } else if (arg == "--check" && i + 1 < argc && CoSimulator::parseBackend(argv[i+1], checkBackend)) {
+            check = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--read-trace" && i + 1 < argc) {
+            std::string error;
+            if (!printTrace(argv[++i], std::cout, error)) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+            return 0;
+        } else if (arg == "--bench") {
+            return runBenchmarks(20000000);
+        } else if (arg == "--save-image" && i + 1 < argc) {
+            saveImage = argv[++i];
+        } else if (arg.size() > 0 && arg[0] != '-') {
+            std::string error;
+            std::shared_ptr<Image> image;
+            if (hasExtension(arg, ".s") || hasExtension(arg, ".asm")) {
+                image.reset(new Image);
+                if (!Assembler().assembleFile(arg, *image, error))
+                    image = nullptr;
+            } else {
+                image = Image::open(arg, error);
+            }
+            if (!image) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+            images.push_back(image);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
 
-    // initialize ROM[] to HLT
-    for (int i=0; i < 0xFFFF; i++)
-        ROM[i] = 0xFFFF;
+    if (workerPort) {
+        FleetWorker worker;
+        worker.threads = batch.threads;
+        std::string error;
+        if (!worker.listen(workerPort, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        worker.serve();
+        return 0;
+    }
 
+    // a new Cpu's ROM[] is all HLT
 
 
     /*
@@ -287,33 +6644,167 @@ int main() {
         HLT
       The corresponding assembled machine code follows...
     */
-    ROM[0] = 0xA200;
-    ROM[1] = 0x0000;
-    ROM[2] = 0xA300;
-    ROM[3] = 0x0001;
-    ROM[4] = 0x0234;
-    ROM[5] = 0x0000;
-    ROM[6] = 0x7400;
-    ROM[7] = 0x0000;
-    ROM[8] = 0x6320;
-    ROM[9] = 0x0000;
-    ROM[10] = 0x6430;
-    ROM[11] = 0x0000;
-    ROM[12] = 0x0234;
-    ROM[13] = 0x0000;
-    ROM[14] = 0x5430;
-    ROM[15] = 0x0000;
-    ROM[16] = 0xE100;
-    ROM[17] = 0x0006;
-
-
-
-    while(!halt) {
-        runInstruction( ROM[reg[0]], ROM[reg[0]+1] );
-        usleep( millisecondsPerInstruction * 1000 );
-
-        //std::cout << reg[0] << ' ' << reg[1] << ' ' << reg[2] << ' ' << reg[3] << ' ' << reg[4] << std::endl;
+    cpu.ROM[0] = 0xA200;
+    cpu.ROM[1] = 0x0000;
+    cpu.ROM[2] = 0xA300;
+    cpu.ROM[3] = 0x0001;
+    cpu.ROM[4] = 0x0234;
+    cpu.ROM[5] = 0x0000;
+    cpu.ROM[6] = 0x7400;
+    cpu.ROM[7] = 0x0000;
+    cpu.ROM[8] = 0x6320;
+    cpu.ROM[9] = 0x0000;
+    cpu.ROM[10] = 0x6430;
+    cpu.ROM[11] = 0x0000;
+    cpu.ROM[12] = 0x0234;
+    cpu.ROM[13] = 0x0000;
+    cpu.ROM[14] = 0x5430;
+    cpu.ROM[15] = 0x0000;
+    cpu.ROM[16] = 0xE100;
+    cpu.ROM[17] = 0x0006;
+
+
+
+    // the Fibonacci program is used unless you give some image files
+    if (images.empty()) {
+        std::shared_ptr<Image> image(new Image);
+        image->addSegment(SEGMENT_ROM, 0, std::vector<uint16_t>(cpu.ROM, cpu.ROM + 18));
+        images.push_back(image);
     }
 
-    return 0;
+    if (!saveImage.empty()) {
+        std::string error;
+        if (images.size() != 1 || !images[0]->save(saveImage, error)) {
+            std::cerr << (error.empty() ? "--save-image saves exactly 1 image" : error) << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (fuse == "none")
+        cpu.fusions = batch.fusions = 0;
+    else if (fuse == "profile")
+        cpu.fusions = batch.fusions = profileFusions(*images[0], 1000000);
+
+    if (batchJobs) {
+        std::vector<Job> jobs;
+        for (const std::shared_ptr<const Image> &image : images) {
+            Job job;
+            job.image = image;
+            job.snapshot = restore;
+            jobs.insert(jobs.end(), batchJobs, job);
+        }
+        if (!nodes.empty() && !profilePath.empty()) {
+            std::cerr << "--profile doesn't work with --nodes" << std::endl;
+            return 1;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<JobResult> results;
+        std::string error;
+        if (!nodes.empty())
+            FleetCoordinator(batch, lanes).run(nodes, jobs, results, error);
+        else if (!lanes)
+            results = batch.run(jobs);
+        else if (!runLanes(lanes, jobs, batch.maxInstructions, batch.ramSeed, results)) {
+            std::cerr << "--lanes can be 8, 16 or 32" << std::endl;
+            return 1;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (const JobResult &result : results) {
+            std::cout << result.output;
+            if (!result.error.empty())
+                std::cerr << result.error << std::endl;
+        }
+        std::cerr << "ran " << jobs.size() << " jobs in " << seconds << " s" << std::endl;
+        if (!error.empty()) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        return (profilePath.empty() || writeProfile(profile, profilePath)) ? 0 : 1;
+    }
+
+    if (images.size() != 1) {
+        std::cerr << "use --batch to run more than 1 image" << std::endl;
+        return 1;
+    }
+    std::string error;
+    if (!cpu.loadImage(*images[0], error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    if (showGraph) {
+        printControlFlowGraph(controlFlowGraph(cpu, cpu.reg[0]), std::cout);
+        return 0;
+    }
+    if (!check.empty()) {
+        if (devices) {
+            std::cerr << "--check doesn't work with --devices" << std::endl;
+            return 1;
+        }
+        CoSimulator checker;
+        checker.output = cpu.output;
+        if (!checker.load(*images[0], restore.get(), checkBackend, batch.ramSeed, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        std::string report;
+        bool same = checker.run(report);
+        std::cerr << report << "checked " << checker.instructions << " instructions of " << check << " against the reference ("
+                  << checker.checks << " checks)" << (same ? ", and they did the same" : "") << std::endl;
+        return same ? 0 : 1;
+    }
+
+    DmaDevice dma;
+    UartDevice uart(std::cin, std::cout);
+    TimerDevice timer;
+    if (devices) {
+        cpu.mapDevice(&dma, 0xFD00, 256, error);
+        cpu.mapDevice(&uart, 0xFE00, 256, error);
+        cpu.mapDevice(&timer, 0xFF00, 256, error);
+    }
+    if (restore)
+        cpu.restoreSnapshot(*restore);
+
+    Tracer tracer;
+    if (!tracePath.empty()) {
+        if (!tracer.open(tracePath, cpu, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        cpu.trace = &tracer;
+    }
+
+    if (gdbPort) {
+        GdbServer server(cpu);
+        if (!server.listen(gdbPort, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        server.serve();
+        cpu.output->flush();
+        return tracer.close() ? 0 : 1;
+    }
+
+    if (!snapshotPath.empty()) {
+        cpu.runBatch(snapshotAfter);
+        cpu.output->flush();
+        Snapshot snapshot;
+        cpu.takeSnapshot(snapshot);
+        if (!snapshot.save(snapshotPath, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    runClocked(cpu, clock);
+    cpu.output->flush();
+    if (!tracer.close()) {
+        std::cerr << "can't write all of " << tracePath << std::endl;
+        return 1;
+    }
+
+    return (profilePath.empty() || writeProfile(profile, profilePath)) ? 0 : 1;
 }
+
+#endif
@@ -0,0 +1,393 @@
+/*
+    Tests for cpu16.cpp. Build and run them with...
+        g++ -std=c++17 -O2 -pthread -o cpu16_test cpu16_test.cpp && ./cpu16_test
+    This includes all of cpu16.cpp (without its main()), so tests can get at everything.
+    Each test prints "ok" or "FAILED" and what went wrong, and ./cpu16_test exits with 1
+    if anything failed. Add -DCPU16_DISPATCH_SWITCH, -DCPU16_NO_JIT or -DCPU16_REGISTERS=16
+    to test those builds too.
+*/
+
+#define CPU16_NO_MAIN
+#include "cpu16.cpp"
+
+int failures = 0;
+
+// counts a failure (and says what it was) unless ok
+bool expect(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cout << "    " << what << std::endl;
+        failures++;
+    }
+    return ok;
+}
+
+std::shared_ptr<Image> assembled(const std::string &source) {
+    std::shared_ptr<Image> image(new Image);
+    std::string error;
+    if (!expect(Assembler().assemble(source, *image, error), "can't assemble: " + error))
+        return nullptr;
+    return image;
+}
+
+std::string temporaryPath(const char *name) {
+    return std::string("/tmp/cpu16_test_") + std::to_string(getpid()) + "_" + name;
+}
+
+const char *fibSource =
+    "        LDV 2, 0x0000\n"
+    "        LDV 3, 0x0001\n"
+    "        ADD 2 3 4\n"
+    "loop:   OUT 4\n"
+    "        CPY 3 2\n"
+    "        CPY 4 3\n"
+    "        ADD 2 3 4\n"
+    "        CMP 4 3\n"
+    "        J 1 0, loop\n"
+    "        HLT\n";
+
+// reads words of RAM it never wrote (which depend on the RAM seed), and writes some
+const char *ramSource =
+    "        LD 2, 0x1234\n"
+    "        OUT 2\n"
+    "        LDV 3, 7\n"
+    "        MOV 3, 0x8001\n"
+    "        LD 2, 0x8001\n"
+    "        ADD 2 3 2\n"
+    "        MOV 2, 0x0000\n"
+    "        LD 4, 0xFFFF\n"
+    "        OUT 4\n"
+    "        OUT 2\n"
+    "        HLT\n";
+
+
+
+// the Fibonacci program assembles to the same words main() has it hand-assembled into,
+// and the compact encoding leaves out the second word of instructions without an address
+void testAssembler() {
+    const std::vector<uint16_t> expected = {
+        0xA200, 0x0000, 0xA300, 0x0001, 0x0234, 0x0000, 0x7400, 0x0000, 0x6320, 0x0000,
+        0x6430, 0x0000, 0x0234, 0x0000, 0x5430, 0x0000, 0xE100, 0x0006, 0xF000, 0x0000 };
+    std::shared_ptr<Image> image = assembled(fibSource);
+    if (image && expect(image->segments.size() == 1, "the ROM should be 1 segment")) {
+        expect(image->segments[0].memory == SEGMENT_ROM && image->segments[0].address == 0, "the segment should be at ROM[0]");
+        expect(image->segments[0].words == expected, "wrong words");
+        expect(!image->compact && image->entry == 0, "wrong header");
+    }
+
+    const std::vector<uint16_t> compact = {
+        0xA200, 0x0000, 0xA300, 0x0001, 0x0234, 0x7400, 0x6320, 0x6430, 0x0234, 0x5430,
+        0xE100, 0x0005, 0xF000 };
+    image = assembled(std::string(".compact\n") + fibSource);
+    if (image && expect(image->segments.size() == 1, "the compact ROM should be 1 segment")) {
+        expect(image->segments[0].words == compact, "wrong compact words");
+        expect(image->compact, "the image should say it's compact");
+    }
+
+    Image bad;
+    std::string error;
+    expect(!Assembler().assemble("        J 1 0, nowhere\n", bad, error) && !error.empty(), "an undefined label should fail");
+    expect(!Assembler().assemble("        ADD 2 3\n", bad, error), "a missing register should fail");
+}
+
+// saving then opening an image gives back the same header and words (and runs the same)
+void testImageFile() {
+    std::shared_ptr<Image> image = assembled(std::string(".compact\n") + fibSource);
+    if (!image)
+        return;
+    image->addSegment(SEGMENT_RAM, 0x0100, {1, 2, 3});
+    image->entry = 0;
+    std::string path = temporaryPath("image.img"), error;
+    if (!expect(image->save(path, error), "can't save: " + error))
+        return;
+    std::shared_ptr<Image> opened = Image::open(path, error);
+    std::remove(path.c_str());
+    if (!expect(opened != nullptr, "can't open: " + error))
+        return;
+    expect(opened->compact && opened->entry == image->entry, "wrong header");
+    if (!expect(opened->segments.size() == 2, "wrong number of segments"))
+        return;
+    for (size_t s = 0; s < 2; s++) {
+        const ImageSegment &a = image->segments[s], &b = opened->segments[s];
+        std::vector<uint16_t> words(b.length);
+        expect(a.memory == b.memory && a.address == b.address && a.length == b.length, "wrong segment " + std::to_string(s));
+        expect(opened->read(b, words.data()) && words == a.words, "wrong words in segment " + std::to_string(s));
+    }
+
+    std::unique_ptr<Cpu> cpu(new Cpu);
+    RecordingSink output;
+    cpu->output = &output;
+    expect(cpu->loadImage(*opened, error), "can't load: " + error);
+    cpu->run(UINT64_MAX);
+    expect(output.values.size() == 23 && output.values.back() == 46368, "the opened image should print the Fibonacci numbers");
+    expect(cpu->RAM.read(0x0102) == 3, "the RAM segment should be loaded");
+
+    expect(!Image::open(temporaryPath("missing.img"), error), "opening a missing file should fail");
+}
+
+// a snapshot saved partway through (with seeded RAM) carries on exactly like the Cpu it came from
+void testSnapshotFile() {
+    std::shared_ptr<Image> image = assembled(ramSource);
+    if (!image)
+        return;
+    std::string error, path = temporaryPath("snapshot.snap");
+    std::unique_ptr<Cpu> a(new Cpu), b(new Cpu);
+    RecordingSink outputA, outputB;
+    a->output = &outputA;
+    b->output = &outputB;
+    a->RAM.reset(42);
+    expect(a->loadImage(*image, error), "can't load: " + error);
+    a->run(7);
+    Snapshot snapshot;
+    a->takeSnapshot(snapshot);
+    if (!expect(snapshot.save(path, error), "can't save: " + error))
+        return;
+    std::shared_ptr<Snapshot> opened = Snapshot::open(path, error);
+    std::remove(path.c_str());
+    if (!expect(opened != nullptr, "can't open: " + error))
+        return;
+    b->RAM.reset(42);   // (pages a snapshot says were never touched start over from the seed)
+    expect(b->loadImage(*image, error), "can't load: " + error);
+    b->restoreSnapshot(*opened);
+    expect(std::equal(a->reg, a->reg + 16, b->reg) && a->cycles == b->cycles && a->halt == b->halt, "wrong registers");
+    outputA.values.clear();
+    a->run(UINT64_MAX);
+    b->run(UINT64_MAX);
+    expect(outputA.values == outputB.values && outputA.values.size() == 2, "they should print the same after the snapshot");
+    expect(std::equal(a->reg, a->reg + 16, b->reg) && a->cycles == b->cycles, "they should end the same");
+    bool same = true;
+    for (uint32_t i = 0; i < 0x10000; i++)
+        same = same && a->RAM.read(i) == b->RAM.read(i);
+    expect(same, "their RAM should end the same");
+}
+
+// every backend does what runInstruction() does, checked the way ./cpu16 --check does it
+void testBackendsAgree() {
+    std::vector< std::pair<std::string, std::shared_ptr<Image>> > programs;
+    programs.push_back(std::make_pair("fib", assembled(fibSource)));
+    programs.push_back(std::make_pair("fib compact", assembled(std::string(".compact\n") + fibSource)));
+    programs.push_back(std::make_pair("ram", assembled(ramSource)));
+    for (const BenchKernel &kernel : benchKernels)
+        programs.push_back(std::make_pair(kernel.name, assembled(kernel.source)));
+    const char *backends[] = {"threaded", "fused", "jit", "tiered", "lanes16"};
+    for (const char *name : backends)
+        for (auto &program : programs) {
+#ifndef CPU16_THREADED
+            if (name == std::string("tiered"))
+                continue;   // (which switch dispatch can't do)
+#endif
+            if (!program.second)
+                continue;
+            CheckBackend backend;
+            CoSimulator checker;
+            RecordingSink output;
+            std::string error, report;
+            checker.output = &output;
+            checker.checkInstructions = 5000;
+            checker.maxInstructions = 200000;   // (the kernels never halt)
+            if (!expect(CoSimulator::parseBackend(name, backend) && checker.load(*program.second, nullptr, backend, 7, error),
+                        std::string("can't load ") + name + ": " + error))
+                continue;
+            expect(checker.run(report), std::string(name) + " differs on " + program.first + ":\n" + report);
+        }
+}
+
+
+// calling runUntil(atPC(x)) again from x carries on to the next time the program gets to x
+// (whether or not a breakpoint is set there) instead of stopping right away
+void testRunUntilAgain() {
+    std::shared_ptr<Image> image = assembled(fibSource);
+    if (!image)
+        return;
+    const uint16_t loop = 0x0006;
+    for (int breakpoint = 0; breakpoint < 2; breakpoint++) {
+        std::unique_ptr<Cpu> cpu(new Cpu);
+        RecordingSink output;
+        std::string error, which = breakpoint ? " (with a breakpoint there)" : "";
+        cpu->output = &output;
+        expect(cpu->loadImage(*image, error), "can't load: " + error);
+        if (breakpoint)
+            cpu->setBreakpoint(loop, true);
+        expect(cpu->runUntil(StopWhen().atPC(loop)) == RUN_REACHED_PC && cpu->reg[0] == loop, "should get to the loop" + which);
+        for (size_t lap = 1; lap <= 3; lap++) {
+            uint64_t cycles = cpu->cycles;
+            expect(cpu->runUntil(StopWhen().atPC(loop)) == RUN_REACHED_PC && cpu->reg[0] == loop, "should get back to the loop" + which);
+            expect(cpu->cycles > cycles && output.values.size() == lap, "calling again should go around the loop" + which);
+        }
+        cpu->runUntil(StopWhen().atPC(loop), 0);
+        expect(cpu->reg[0] == loop && output.values.size() == 3, "a budget of 0 should run nothing" + which);
+    }
+}
+
+// a lane stuck in a loop below the others' program counters can't keep them from finishing
+void testLanesDontStarve() {
+    std::shared_ptr<Image> image = assembled(
+        "        LD 2, 0x0000\n"
+        "        LDV 3, 0\n"
+        "        J 2 0, start\n"
+        "spin:   J 2 0, spin\n"
+        "start:  CMP 2 3\n"
+        "        J 0 1, spin\n"     // lanes with an input other than 0 spin forever
+        "        LDV 4, 0\n"
+        "        ADD 4 4 4\n"
+        "        OUT 4\n"
+        "        HLT\n");
+    if (!image)
+        return;
+    std::unique_ptr< LaneCpu<16> > lanes(new LaneCpu<16>);
+    std::string error;
+    RecordingSink output[16];
+    expect(lanes->load(image.get(), nullptr, error), "can't load: " + error);
+    for (int l = 0; l < 16; l++) {
+        lanes->loadInput(l, {(uint16_t)(l % 3 == 0)});
+        lanes->output[l] = &output[l];
+    }
+    lanes->run(100000);
+    for (int l = 0; l < 16; l++)
+        if (l % 3 == 0)
+            expect(!lanes->halt[l], "lane " + std::to_string(l) + " should still be spinning");
+        else
+            expect(lanes->halt[l] && output[l].values.size() == 1, "lane " + std::to_string(l) + " should have halted");
+}
+
+// a batch run tiered (where the Cpus share their promotions, see TieredROM) gets the same results
+// as one run without it, on several threads
+void testTieredBatch() {
+#ifdef CPU16_THREADED
+    std::vector<Job> jobs;
+    for (const char *source : {fibSource, benchKernels[0].source, benchKernels[3].source}) {
+        Job job;
+        job.image = assembled(source);
+        if (!job.image)
+            return;
+        for (uint16_t i = 0; i < 40; i++) {
+            job.input = {i};
+            jobs.push_back(job);
+        }
+    }
+    std::vector<JobResult> results[2];
+    for (int tiered = 0; tiered < 2; tiered++) {
+        BatchRunner runner;
+        runner.threads = 4;
+        runner.sliceInstructions = 1000;
+        runner.maxInstructions = 300000;
+        runner.tiered = tiered;
+        results[tiered] = runner.run(jobs);
+    }
+    for (size_t j = 0; j < jobs.size(); j++) {
+        const JobResult &a = results[0][j], &b = results[1][j];
+        if (!expect(a.halted == b.halted && a.instructions == b.instructions && std::equal(a.reg, a.reg + 16, b.reg)
+                      && a.output == b.output, "job " + std::to_string(j) + " ran differently with tiered"))
+            return;
+    }
+#endif
+}
+
+// a full block of each kind of instruction, translated right at the end of the JIT's code memory,
+// fits in what translate() makes room for (with -DCPU16_REGISTERS=16, using registers kept in reg[])
+void testJitBlockFits() {
+#ifdef CPU16_JIT
+    std::string r = std::to_string(cpuRegisters - 1), s = std::to_string(cpuRegisters - 2);
+    const std::string instructions[] = {
+        "ADD " + r + " " + s + " " + r, "AND " + r + " " + s, "OR " + r + " " + s, "CMP " + r + " " + s,
+        "CPY " + r + " " + s, "OUT " + r, "MOV " + r + ", 0x0100", "MOV " + r + ", 0xFF00",
+        "LD " + r + ", 0x0100", "LD " + r + ", 0xFF00", "LDV " + r + ", 0x1234", "J 1 0, 0x0000", "J 2 0, 0x0000", "HLT" };
+    for (const std::string &instruction : instructions) {
+        std::string source;
+        for (int i = 0; i < jitMaxBlockLength; i++)
+            source += "        " + instruction + "\n";
+        std::shared_ptr<Image> image = assembled(source);
+        if (!image)
+            return;
+        std::unique_ptr<Cpu> cpu(new Cpu);
+        RecordingSink output;
+        cpu->output = &output;
+        TimerDevice timer;
+        std::string error;
+        if (!expect(cpu->mapDevice(&timer, 0xFF00, 256, error) && cpu->loadImage(*image, error), error))
+            return;
+        cpu->setFusions(0);
+        cpu->predecodeROM();
+        std::unique_ptr<Jit> jit(new Jit);
+        if (!expect(jit->init(), "no executable memory for the JIT"))
+            return;
+        size_t bytes = jitBlockBytes;
+        for (uint16_t pc = 0, n = 0; n < jitMaxBlockLength && Jit::canTranslate(cpu->decodedROM[pc]); pc += cpu->decodedROM[pc].words) {
+            bytes += Jit::maxCodeBytes(cpu->decodedROM[pc]);
+            n++;
+            if (cpu->decodedROM[pc].opcode == 0xE || cpu->decodedROM[pc].opcode == 0xF)
+                break;
+        }
+        jit->used = jitCodeSize - bytes;   // so it only just fits
+        uint8_t *entry = jit->translate(*cpu, 0);
+        expect(entry == jit->code + jitCodeSize - bytes && jit->used <= jitCodeSize,
+               "a block of " + instruction + " took " + std::to_string(jit->used - (jitCodeSize - bytes))
+               + " bytes, more than the " + std::to_string(bytes) + " translate() made room for");
+    }
+#endif
+}
+
+// a trace file whose header says it has more registers than it can hold is turned away
+void testTraceRegisters() {
+    std::string path = temporaryPath("trace.c16t"), error;
+    for (uint16_t registers : {16, 17, 0xFFFF}) {
+        uint8_t header[42] = { 'C', '1', '6', 'T', 2, 0, (uint8_t)registers, (uint8_t)(registers >> 8) };
+        FILE *file = fopen(path.c_str(), "wb");
+        if (!expect(file && fwrite(header, 1, sizeof(header), file) == sizeof(header), "can't write " + path))
+            return;
+        fclose(file);
+        std::ostringstream text;
+        bool printed = printTrace(path, text, error);
+        expect(printed == (registers <= 16), "printing a trace with " + std::to_string(registers) + " registers "
+                                             + (printed ? "should fail" : "failed: " + error));
+    }
+    std::remove(path.c_str());
+}
+
+// more threads than jobs (so some only ever wait), and a ROMCache kept from one run to the next
+void testBatchIdleWorkers() {
+    Job job;
+    job.image = assembled(fibSource);
+    if (!job.image)
+        return;
+    job.imageHash = 1;
+    std::vector<Job> jobs(3, job);
+    Cpu cpu;
+    RecordingSink output;
+    cpu.output = &output;
+    std::string error;
+    if (!expect(cpu.loadImage(*job.image, error), error))
+        return;
+    uint64_t instructions = cpu.runBatch(UINT64_MAX);
+    BatchRunner runner;
+    runner.threads = 8;
+    runner.sliceInstructions = 10;
+    runner.roms = std::make_shared<ROMCache>();
+    for (int run = 0; run < 2; run++)
+        for (const JobResult &result : runner.run(jobs))
+            if (!expect(result.halted && result.instructions == instructions && std::equal(cpu.reg, cpu.reg + 16, result.reg),
+                        "run " + std::to_string(run) + " ran differently in a batch"))
+                return;
+}
+
+int main() {
+    const struct { const char *name; void (*run)(); } tests[] = {
+        { "assembler", testAssembler },
+        { "image file", testImageFile },
+        { "snapshot file", testSnapshotFile },
+        { "backends agree", testBackendsAgree },
+        { "runUntil again", testRunUntilAgain },
+        { "lanes don't starve", testLanesDontStarve },
+        { "tiered batch", testTieredBatch },
+        { "JIT block fits", testJitBlockFits },
+        { "trace registers", testTraceRegisters },
+        { "batch idle workers", testBatchIdleWorkers },
+    };
+    for (const auto &test : tests) {
+        int before = failures;
+        std::cout << test.name << std::endl;
+        test.run();
+        std::cout << (failures == before ? "    ok" : "    FAILED") << std::endl;
+    }
+    std::cout << (failures ? "some tests FAILED" : "all tests passed") << std::endl;
+    return failures ? 1 : 0;
+}